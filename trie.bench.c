@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "trie.h"
+
+/* Benchmark harness
+ * Usage: trie.bench.exe [--perf] [max_values]
+ * Every distribution is run at sizes 1K, 10K, ... up to max_values (default 10M) and
+ * compared to the flat counter array the property test uses as its oracle.
+ * --perf also samples the cache and branch misses of trie_insert_value through
+ * perf_event_open. */
+
+#define NELEMS( _x ) \
+    ( sizeof( _x ) / sizeof( *_x ) )
+
+/* Values are generated outside the timed sections, one block at a time */
+#define BENCH_BLOCK_SIZE ( 1 << 20 )
+
+typedef struct {
+    uint64_t state;
+    double* zipf_cdfp;
+    uint64_t sequence;
+} BenchGen_t;
+
+typedef uint16_t (*BenchDistribution_t)(BenchGen_t* genp);
+
+static uint64_t bench_random(BenchGen_t* genp) {
+    /* xorshift64* */
+    genp->state ^= genp->state >> 12;
+    genp->state ^= genp->state << 25;
+    genp->state ^= genp->state >> 27;
+    return genp->state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint16_t bench_uniform(BenchGen_t* genp) {
+    return (uint16_t)(bench_random(genp) >> 48);
+}
+
+static uint16_t bench_sequential(BenchGen_t* genp) {
+    return (uint16_t)(genp->sequence++);
+}
+
+static uint16_t bench_same_value(BenchGen_t* genp) {
+    (void)genp;
+    /* Every burst cascades all the way down to the count nodes */
+    return 4242;
+}
+
+static uint16_t bench_zipf(BenchGen_t* genp) {
+    /* Pick a rank from the CDF, then scatter ranks over the key space so the hot
+     * values don't all share a subtrie */
+    double u = (double)(bench_random(genp) >> 11) / (double)(1ULL << 53);
+    uint32_t lo = 0, hi = USHRT_MAX;
+    while(lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if(genp->zipf_cdfp[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (uint16_t)(lo * 40503u);
+}
+
+static uint16_t bench_latency(BenchGen_t* genp) {
+    /* A bell around 1200 with a long sparse tail, like request latencies */
+    uint64_t r = bench_random(genp);
+    if((r & 0xFF) == 0) {
+        return (uint16_t)(r >> 48);
+    }
+    uint32_t sum = 0;
+    for(uint8_t i = 0; i < 4; i++) {
+        sum += (r >> (8 + i*12)) & 0x1FF;
+    }
+    return (uint16_t)(200 + sum);
+}
+
+/* Zipf with an exponent of 1 over the whole key space */
+static double* bench_zipf_cdf(void) {
+    double* cdfp = malloc((USHRT_MAX + 1) * sizeof(*cdfp));
+    double total = 0;
+    for(uint32_t i = 0; i <= USHRT_MAX; i++) {
+        total += 1.0 / (double)(i + 1);
+        cdfp[i] = total;
+    }
+    for(uint32_t i = 0; i <= USHRT_MAX; i++) {
+        cdfp[i] /= total;
+    }
+    return cdfp;
+}
+
+/* Hardware counters around the single insert loop */
+typedef enum {
+    BENCH_PERF_CACHE_MISSES,
+    BENCH_PERF_BRANCH_MISSES,
+    BENCH_PERF_COUNTERS
+} BenchPerfCounter_t;
+
+typedef struct {
+    bool enabled;
+    int fds[BENCH_PERF_COUNTERS];
+    uint64_t totals[BENCH_PERF_COUNTERS];
+} BenchPerf_t;
+
+static bool bench_perf_open(BenchPerf_t* perfp) {
+#ifdef __linux__
+    const uint64_t configs[BENCH_PERF_COUNTERS] = {
+        [BENCH_PERF_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+        [BENCH_PERF_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for(int i = 0; i < BENCH_PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perfp->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if(perfp->fds[i] < 0) {
+            while(i-- > 0) {
+                close(perfp->fds[i]);
+            }
+            return false;
+        }
+    }
+    perfp->enabled = true;
+    return true;
+#else
+    (void)perfp;
+    return false;
+#endif
+}
+
+static void bench_perf_start(BenchPerf_t* perfp) {
+#ifdef __linux__
+    for(int i = 0; perfp->enabled && i < BENCH_PERF_COUNTERS; i++) {
+        ioctl(perfp->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static void bench_perf_stop(BenchPerf_t* perfp) {
+#ifdef __linux__
+    for(int i = 0; perfp->enabled && i < BENCH_PERF_COUNTERS; i++) {
+        uint64_t value;
+        ioctl(perfp->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if(read(perfp->fds[i], &value, sizeof(value)) == sizeof(value)) {
+            perfp->totals[i] += value;
+        }
+        ioctl(perfp->fds[i], PERF_EVENT_IOC_RESET, 0);
+    }
+#endif
+}
+
+static void bench_perf_close(BenchPerf_t* perfp) {
+#ifdef __linux__
+    for(int i = 0; perfp->enabled && i < BENCH_PERF_COUNTERS; i++) {
+        close(perfp->fds[i]);
+    }
+#endif
+    perfp->enabled = false;
+}
+
+static double bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+typedef struct {
+    uint64_t distinct;
+    uint64_t total;
+} BenchWalk_t;
+
+static bool bench_visit(void* ctxp, uint16_t value, uint64_t count) {
+    BenchWalk_t* walkp = ctxp;
+    (void)value;
+    ++walkp->distinct;
+    walkp->total += count;
+    return true;
+}
+
+typedef struct {
+    const char* name;
+    BenchDistribution_t generate;
+} BenchCase_t;
+
+static void bench_run(const BenchCase_t* casep, uint64_t n, double* zipf_cdfp, uint16_t* blockp, BenchPerf_t* perfp) {
+    BenchGen_t gen = { .state = 0x9E3779B97F4A7C15ULL, .zipf_cdfp = zipf_cdfp };
+    struct sTrie* single_triep = trie_init();
+    struct sTrie* batch_triep = trie_init();
+    const struct sTrieConfig vertical_config = { .vertical = true };
+    struct sTrie* vertical_triep = trie_init_ex(&vertical_config);
+    const struct sTrieConfig hot_config = { .hot_values = true };
+    struct sTrie* hot_triep = trie_init_ex(&hot_config);
+    struct sTrie16x16* fan16_triep = trie16x16_init();
+    struct sTrie16x64* fan64_triep = trie16x64_init();
+    uint64_t* flatp = calloc(USHRT_MAX + 1, sizeof(*flatp));
+    double single_ns = 0, batch_ns = 0, vertical_ns = 0, fan16_ns = 0, fan64_ns = 0, hot_ns = 0, flat_ns = 0;
+
+    for(uint64_t done = 0; done < n; ) {
+        size_t block = (n - done) < BENCH_BLOCK_SIZE ? (size_t)(n - done) : BENCH_BLOCK_SIZE;
+        for(size_t i = 0; i < block; i++) {
+            blockp[i] = casep->generate(&gen);
+        }
+        bench_perf_start(perfp);
+        double start = bench_now_ns();
+        for(size_t i = 0; i < block; i++) {
+            trie_insert_value(single_triep, blockp[i]);
+        }
+        double middle = bench_now_ns();
+        bench_perf_stop(perfp);
+        trie_insert_values(batch_triep, blockp, block);
+        double end = bench_now_ns();
+        for(size_t i = 0; i < block; i++) {
+            ++flatp[blockp[i]];
+        }
+        double flat_end = bench_now_ns();
+        for(size_t i = 0; i < block; i++) {
+            trie_insert_value(vertical_triep, blockp[i]);
+        }
+        double vertical_end = bench_now_ns();
+        for(size_t i = 0; i < block; i++) {
+            trie16x16_insert_value(fan16_triep, blockp[i]);
+        }
+        double fan16_end = bench_now_ns();
+        for(size_t i = 0; i < block; i++) {
+            trie16x64_insert_value(fan64_triep, blockp[i]);
+        }
+        double fan64_end = bench_now_ns();
+        for(size_t i = 0; i < block; i++) {
+            trie_insert_value(hot_triep, blockp[i]);
+        }
+        hot_ns += bench_now_ns() - fan64_end;
+        fan64_ns += fan64_end - fan16_end;
+        fan16_ns += fan16_end - vertical_end;
+        vertical_ns += vertical_end - flat_end;
+        flat_ns += flat_end - end;
+        single_ns += middle - start;
+        batch_ns += end - middle;
+        done += block;
+    }
+
+    BenchWalk_t walk = {0};
+    double start = bench_now_ns();
+    trie_visit(single_triep, bench_visit, &walk);
+    double walk_ns = bench_now_ns() - start;
+
+    BenchWalk_t flat_walk = {0};
+    start = bench_now_ns();
+    for(uint32_t v = 0; v <= USHRT_MAX; v++) {
+        if(flatp[v] != 0) {
+            bench_visit(&flat_walk, v, flatp[v]);
+        }
+    }
+    double flat_walk_ns = bench_now_ns() - start;
+
+    TrieStats_t stats;
+    trie_get_stats(single_triep, &stats);
+    size_t bytes = stats.bytes_used;
+    start = bench_now_ns();
+    trie_free(&single_triep);
+    double free_ns = bench_now_ns() - start;
+    trie_free(&batch_triep);
+    trie_free(&vertical_triep);
+    trie_free(&hot_triep);
+    size_t fan16_bytes = fan16_triep->arena.bytes_used;
+    size_t fan64_bytes = fan64_triep->arena.bytes_used;
+    trie16x16_free(&fan16_triep);
+    trie16x64_free(&fan64_triep);
+    free(flatp);
+
+    if(walk.total != n || flat_walk.distinct != walk.distinct) {
+        fprintf(stderr, "%s: trie holds %lu values, expected %lu\n", casep->name, (unsigned long)walk.total, (unsigned long)n);
+        exit(EXIT_FAILURE);
+    }
+    printf("%-10s %11lu %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %10.2f %10lu %10.1f %10.1f %10.1f %6.3f %10.3f %10.3f %10.3f",
+           casep->name, (unsigned long)n,
+           single_ns / n, batch_ns / n, vertical_ns / n, fan16_ns / n, fan64_ns / n, hot_ns / n, 1e3 * n / single_ns, flat_ns / n,
+           (double)bytes / walk.distinct, (unsigned long)walk.distinct,
+           (double)bytes / 1024.0, (double)fan16_bytes / 1024.0, (double)fan64_bytes / 1024.0, stats.data_fill_factor,
+           walk_ns / 1e6, flat_walk_ns / 1e6, free_ns / 1e6);
+    if(perfp->enabled) {
+        printf(" %9.3f %9.3f",
+               (double)perfp->totals[BENCH_PERF_CACHE_MISSES] / n,
+               (double)perfp->totals[BENCH_PERF_BRANCH_MISSES] / n);
+        memset(perfp->totals, 0, sizeof(perfp->totals));
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    uint64_t max_values = 10000000;
+    BenchPerf_t perf = {0};
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--perf") == 0) {
+            if(!bench_perf_open(&perf)) {
+                fprintf(stderr, "perf_event_open is not available, running without hardware counters\n");
+            }
+        } else {
+            max_values = strtoull(argv[i], NULL, 10);
+        }
+    }
+    const BenchCase_t cases[] = {
+        { "uniform", bench_uniform },
+        { "zipf", bench_zipf },
+        { "sequential", bench_sequential },
+        { "same", bench_same_value },
+        { "latency", bench_latency },
+    };
+    double* zipf_cdfp = bench_zipf_cdf();
+    uint16_t* blockp = malloc(BENCH_BLOCK_SIZE * sizeof(*blockp));
+
+    printf("%-10s %11s %9s %9s %9s %9s %9s %9s %9s %9s %10s %10s %10s %10s %10s %6s %10s %10s %10s",
+           "dist", "values", "ns/ins", "ns/batch", "ns/vert", "ns/x16", "ns/x64", "ns/hot", "Mins/s", "ns/flat",
+           "B/distinct", "distinct", "arena KiB", "x16 KiB", "x64 KiB", "fill", "walk ms", "flat ms", "free ms");
+    if(perf.enabled) {
+        printf(" %9s %9s", "miss/ins", "brmis/ins");
+    }
+    printf("\n");
+    for(size_t c = 0; c < NELEMS(cases); c++) {
+        for(uint64_t n = 1000; n <= max_values; n *= 10) {
+            bench_run(&cases[c], n, zipf_cdfp, blockp, &perf);
+        }
+    }
+    bench_perf_close(&perf);
+    free(blockp);
+    free(zipf_cdfp);
+    return 0;
+}
@@ -29,10 +29,16 @@
  *  A node at the maximum trie depth is a CountNode. Count nodes are just counter buckets the accumulate the amount of a specific value. In the above
  *  example, the bottom right nodes are all count nodes. The value of 200 indicates that the value 65535 was stored 200 times.
  *
+ * Nodes are allocated horizontally by default, one slab of siblings after another in burst order. The vertical
+ * option instead gives each top level subtrie its own run of memory, so a walk down the trie stays close to
+ * where it started.
+ *
+ * A count node only ever uses the buckets for value and value+1, so the 8 count nodes under a travel node are packed
+ * next to each other in two cache lines instead of taking a full node each. The figure above still draws them as
+ * separate nodes.
+ *
  * Possible future improvements:
- *  Allocate the memory of the trie vertically instead of horizontally. This would get us some prefetching as we walk down the trie.
- *  Write an iterative solution to walking to trie in order. This would reduce the overhead incurred by recursion.
- *  The count buckets can be 4 times larger (256 bits instead of 64 bits) or the count buckets can be tagged with the values stored in them.
+ *  The count buckets can be tagged with the values stored in them.
 */
 #include "trie.h"
 
@@ -43,6 +49,16 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__) && !defined(TRIE_NO_SIMD)
+#define TRIE_SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
 
 #define NELEMS( _x ) \
     ( sizeof( _x ) / sizeof( *_x ) )
@@ -65,6 +81,64 @@ const uint16_t mask_array [] = {0b1110000000000000,
     ( (__val & GEN_MASK(__depth)) >> GEN_SHIFT(__depth) )
 
 #define TRIE_MAX_DEPTH ( 5 )
+_Static_assert(TRIE_MAX_DEPTH < TRIE_ITER_STACK_DEPTH, "TrieIter_t stack is too shallow");
+_Static_assert(TRIE_MAX_DEPTH < TRIE_LEVELS, "TrieCounters_t has too few levels");
+_Static_assert(TRIE_DIRECT_LEVELS_MAX < TRIE_MAX_DEPTH, "The direct table would reach the count nodes");
+
+/* Concurrent inserts lock a data node by putting this in data[0]. Travel nodes always
+ * have bit 0 set there and a data node's data[0] is only ever non-zero right before it
+ * bursts, so the marker can't be mistaken for either */
+#define TRIE_DATA_NODE_LOCKED ( 0x2 )
+/* First word of a packed node. Like the lock marker it can't be a travel link or the
+ * data[0] of a data node that is not about to burst */
+#define TRIE_PACKED_NODE_MARKER ( 0x4 )
+
+/* Arena chunks start small so tiny tries stay tiny, then double up to a huge page */
+#define TRIE_ARENA_MIN_CHUNK_SIZE ( 64 * 1024 )
+#define TRIE_ARENA_MAX_CHUNK_SIZE ( 2 * 1024 * 1024 )
+
+/* Buckets a count node actually uses, which is also the spacing of the packed count
+ * nodes under a travel node at TRIE_MAX_DEPTH - 1 */
+#define TRIE_COUNT_NODE_BUCKETS ( 2 )
+
+/* A compact link is the index of a chunk in the chunk table and the cache line of the
+ * slab in that chunk. The tag bit leaves 31 bits for the two */
+#define TRIE_COMPACT_LINE_BITS ( 15 )
+#define TRIE_COMPACT_CHUNK_BITS ( 16 )
+_Static_assert((CACHE_LINE_SIZE << TRIE_COMPACT_LINE_BITS) == TRIE_ARENA_MAX_CHUNK_SIZE, "A compact link can't reach every line of a chunk");
+_Static_assert(TRIE_COMPACT_LINE_BITS + TRIE_COMPACT_CHUNK_BITS == 31, "A compact link has to fit next to the tag bit");
+/* The link totals of a compact travel node are 7 bytes each, from byte 4 on */
+#define TRIE_COMPACT_TOTAL_BYTES ( 7 )
+#define TRIE_COMPACT_TOTAL_MASK ( ((uint64_t)1 << (8 * TRIE_COMPACT_TOTAL_BYTES)) - 1 )
+
+/* trie_print_values_parallel hands out the subtries at this depth, so up to 512 of them */
+#define TRIE_PARALLEL_SPLIT_DEPTH ( 3 )
+
+/* Bytes trie_insert_fd reads per block, each of its two buffers holds one */
+#define TRIE_INGEST_BLOCK_SIZE ( 1024 * 1024 )
+
+/* Bytes of text trie_print_values collects before each fwrite */
+#define TRIE_PRINT_BUFFER_SIZE ( 64 * 1024 )
+
+/* Only every this many misses of the hot value table move its clock hand */
+#define TRIE_HOT_MISS_SAMPLE ( 8 )
+
+/* Number of values trie_insert_values partitions at a time */
+#define TRIE_BATCH_BLOCK_SIZE ( 1024 )
+/* How many values ahead trie_insert_values starts fetching the path of a value */
+#define TRIE_BATCH_PREFETCH_DISTANCE ( 8 )
+/* Number of values an interleaved trie_insert_values walks down the trie side by side */
+#define TRIE_BATCH_INTERLEAVE ( 16 )
+
+/* Bump one of the insert path counters. Concurrent tries bump them atomically */
+#ifdef TRIE_STATS
+#define TRIE_STAT_ADD(__triep, __counter, __n) \
+    ( (__triep)->config.concurrent ? \
+      (void)__atomic_fetch_add(&(__triep)->counters.__counter, (__n), __ATOMIC_RELAXED) : \
+      (void)((__triep)->counters.__counter += (__n)) )
+#else
+#define TRIE_STAT_ADD(__triep, __counter, __n) ( (void)0 )
+#endif
 
 #define TAG_PTR(__ptr) \
     ( (typeof(__ptr))((uintptr_t)__ptr | 0x1 ) )
@@ -77,207 +151,2938 @@ typedef enum {
     NODE_TYPE_NONE,
     NODE_TYPE_DATA,
     NODE_TYPE_TRAVEL,
+    NODE_TYPE_PACKED,
     NODE_TYPE_COUNT /* Note: This is a counting bucket do not use as an enum end marker */
 } NodeType_t;
 
-/* Small helper functions */
-static void trie__alloc_node(struct sNode** new_nodepp) {
-    *new_nodepp = (struct sNode*)aligned_alloc(CACHE_LINE_SIZE, sizeof(**new_nodepp));
-    if(*new_nodepp == NULL) {
-        assert(!"Node allocation failed");
+/* Arena allocator
+ * Nodes are never freed one at a time, so the arena just bumps a cursor through a list
+ * of large chunks. Freeing the trie releases the chunks, and resetting it rewinds the
+ * cursor to the first chunk so the memory is reused. */
+static struct sTrieArenaChunk* trie__arena_new_chunk(struct sTrieArena* arenap, size_t min_size) {
+    size_t size = TRIE_ARENA_MIN_CHUNK_SIZE;
+    if(arenap->current != NULL) {
+        size = arenap->current->size * 2;
+        size = size > TRIE_ARENA_MAX_CHUNK_SIZE ? TRIE_ARENA_MAX_CHUNK_SIZE : size;
+    }
+    if(min_size > size) {
+        /* Only compaction asks for more, chunks past the maximum size come in whole
+         * huge pages */
+        size_t granule = (min_size > TRIE_ARENA_MAX_CHUNK_SIZE) ? TRIE_ARENA_MAX_CHUNK_SIZE : CACHE_LINE_SIZE;
+        size = (min_size + granule - 1) / granule * granule;
+    }
+    struct sTrieArenaChunk* chunkp = aligned_alloc(size >= TRIE_ARENA_MAX_CHUNK_SIZE ? TRIE_ARENA_MAX_CHUNK_SIZE : CACHE_LINE_SIZE, size);
+    if(chunkp == NULL) {
+        assert(!"Arena chunk allocation failed");
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if(size >= TRIE_ARENA_MAX_CHUNK_SIZE) {
+        /* Best effort, the chunk works fine with regular pages */
+        madvise(chunkp, size, MADV_HUGEPAGE);
+    }
+#endif
+    chunkp->next = NULL;
+    chunkp->size = size;
+    chunkp->index = UINT32_MAX;
+    if(arenap->current == NULL) {
+        arenap->chunks = chunkp;
+    } else {
+        arenap->current->next = chunkp;
+    }
+    arenap->bytes_reserved += size;
+    return chunkp;
+}
+
+/* Returns zeroed, cache line aligned memory */
+static void* trie__arena_alloc(struct sTrieArena* arenap, size_t size) {
+    assert(size % CACHE_LINE_SIZE == 0);
+    while(arenap->current == NULL || arenap->cursor + size > (uint8_t*)arenap->current + arenap->current->size) {
+        /* After a reset the following chunks are already there to be reused */
+        struct sTrieArenaChunk* nextp = (arenap->current != NULL) ? arenap->current->next : arenap->chunks;
+        if(nextp == NULL) {
+            nextp = trie__arena_new_chunk(arenap, 0);
+        }
+        arenap->current = nextp;
+        /* The chunk header takes the first cache line so the nodes stay aligned */
+        arenap->cursor = (uint8_t*)nextp + CACHE_LINE_SIZE;
+    }
+    void* memp = arenap->cursor;
+    arenap->cursor += size;
+    arenap->bytes_used += size;
+    bzero(memp, size);
+    return memp;
+}
+
+static void trie__arena_reset(struct sTrieArena* arenap) {
+    arenap->current = NULL;
+    arenap->cursor = NULL;
+    arenap->bytes_used = 0;
+}
+
+static void trie__arena_free(struct sTrieArena* arenap) {
+    struct sTrieArenaChunk* chunkp = arenap->chunks;
+    while(chunkp != NULL) {
+        struct sTrieArenaChunk* nextp = chunkp->next;
+        free(chunkp);
+        chunkp = nextp;
+    }
+    bzero(arenap, sizeof(*arenap));
+}
+
+static void trie__cpu_relax(uint32_t* spinsp) {
+    /* Back off to the scheduler if the owner is taking a while, it may not be running */
+    if(++(*spinsp) % 64 == 0) {
+        sched_yield();
+    } else {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+static size_t trie__slab_counts_size(struct sTrie* triep) {
+    return (triep->config.counted && !triep->config.compact_links) ? sizeof(CountNode_t) : 0;
+}
+
+/* Bytes allocated per burst of a node at depth. The subnodes of the last travel level
+ * are packed count nodes. A counted trie keeps the totals of the 8 links in an extra
+ * count node in front of the subnodes, unless the travel node has room for them */
+static size_t trie__slab_size(struct sTrie* triep, uint8_t depth) {
+    size_t size = NELEMS(((TravelNode_t*)0)->link) * sizeof(Node_t);
+    if(depth == TRIE_MAX_DEPTH - 1) {
+        size = NELEMS(((TravelNode_t*)0)->link) * TRIE_COUNT_NODE_BUCKETS * sizeof(uint64_t);
+    }
+    return size + trie__slab_counts_size(triep);
+}
+
+/* Subnode i of the slab for a travel node at depth */
+static Node_t* trie__slab_child(Node_t* slabp, uint8_t depth, uint8_t i) {
+    if(depth == TRIE_MAX_DEPTH - 1) {
+        return (Node_t*)((uint64_t*)slabp + i * TRIE_COUNT_NODE_BUCKETS);
+    }
+    return &slabp[i];
+}
+
+/* The link totals of a counted trie sit right in front of the subnodes */
+static uint64_t* trie__slab_counts(Node_t* slabp) {
+    return ((CountNode_t*)slabp - 1)->count;
+}
+
+/* A freshly allocated slab. index is only set for tries with compact links */
+typedef struct {
+    Node_t* nodes;
+    uint32_t index;
+} TrieSlab_t;
+
+/* A slab on the free list, written over its first subnode */
+typedef struct sTrieFreeSlab {
+    struct sTrieFreeSlab* next;
+    uint32_t index;
+} TrieFreeSlab_t;
+
+static void trie__free_slab(struct sTrie* triep, TrieSlab_t slab, uint8_t depth) {
+    TrieFreeSlab_t* freep = (TrieFreeSlab_t*)slab.nodes;
+    freep->next = triep->free_slabs[depth];
+    freep->index = slab.index;
+    triep->free_slabs[depth] = freep;
+    triep->free_slab_bytes += trie__slab_size(triep, depth);
+}
+
+/* Take a slab off the free list for depth and zero it like a fresh one */
+static bool trie__reuse_slab(struct sTrie* triep, uint8_t depth, TrieSlab_t* slabp) {
+    TrieFreeSlab_t* freep = triep->free_slabs[depth];
+    if(freep == NULL) {
+        return false;
     }
-    bzero(*new_nodepp, sizeof(struct sNode));
+    size_t size = trie__slab_size(triep, depth);
+    triep->free_slabs[depth] = freep->next;
+    triep->free_slab_bytes -= size;
+    slabp->nodes = (Node_t*)freep;
+    slabp->index = freep->index;
+    bzero((uint8_t*)slabp->nodes - trie__slab_counts_size(triep), size);
+    return true;
+}
+
+/* The arena index of the slab at slabp, which was just carved out of arenap. Chunks get
+ * their place in the chunk table the first time a slab comes out of them */
+static uint32_t trie__compact_slab_index(struct sTrie* triep, struct sTrieArena* arenap, Node_t* slabp) {
+    struct sTrieArenaChunk* chunkp = arenap->current;
+    if(chunkp->index == UINT32_MAX) {
+        if(triep->chunk_count == triep->chunk_capacity) {
+            triep->chunk_capacity = triep->chunk_capacity ? 2 * triep->chunk_capacity : 16;
+            triep->chunk_table = realloc(triep->chunk_table, triep->chunk_capacity * sizeof(*triep->chunk_table));
+            assert(triep->chunk_table != NULL);
+        }
+        assert(triep->chunk_count < ((uint32_t)1 << TRIE_COMPACT_CHUNK_BITS));
+        chunkp->index = triep->chunk_count;
+        triep->chunk_table[triep->chunk_count++] = chunkp;
+    }
+    uint32_t line = ((uint8_t*)slabp - (uint8_t*)chunkp) / CACHE_LINE_SIZE;
+    return (chunkp->index << TRIE_COMPACT_LINE_BITS) | line;
+}
+
+/* Allocate the slab of subnodes for a travel node at depth covering value. Vertical
+ * tries take everything below the base node from the lane of its top level subtrie.
+ * The arena is only locked for concurrent tries, where bursts can race each other.
+ * The slab starts at the first subnode */
+static TrieSlab_t trie__alloc_slab(struct sTrie* triep, uint16_t value, uint8_t depth) {
+    struct sTrieArena* arenap = &triep->arena;
+    size_t size = trie__slab_size(triep, depth);
+    size_t counts_size = trie__slab_counts_size(triep);
+    TrieSlab_t slab = { .index = 0 };
+    if(triep->config.vertical && depth > 0) {
+        arenap = &triep->lanes[IDX_FROM_VALUE(value,0)];
+    }
+    if(!triep->config.concurrent) {
+        if(trie__reuse_slab(triep, depth, &slab)) {
+            return slab;
+        }
+        slab.nodes = (Node_t*)((uint8_t*)trie__arena_alloc(arenap, size) + counts_size);
+        if(triep->config.compact_links) {
+            slab.index = trie__compact_slab_index(triep, arenap, slab.nodes);
+        }
+        return slab;
+    }
+    uint32_t spins = 0;
+    while(__atomic_exchange_n(&triep->arena_lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        trie__cpu_relax(&spins);
+    }
+    if(!trie__reuse_slab(triep, depth, &slab)) {
+        slab.nodes = (Node_t*)((uint8_t*)trie__arena_alloc(arenap, size) + counts_size);
+    }
+    __atomic_store_n(&triep->arena_lock, 0, __ATOMIC_RELEASE);
+    return slab;
+}
+
+/* Small helper functions */
+static void trie__alloc_node(struct sTrie* triep, struct sNode** new_nodepp) {
+    *new_nodepp = (struct sNode*)trie__arena_alloc(&triep->arena, sizeof(**new_nodepp));
 }
 
 static NodeType_t trie__determine_node_type(struct sNode* nodep, uint8_t current_depth) {
     if(current_depth == TRIE_MAX_DEPTH) {
         return NODE_TYPE_COUNT;
     }
-    return (((DataNode_t*)nodep)->data[0] == 0) ? NODE_TYPE_DATA : NODE_TYPE_TRAVEL;
+    uint16_t head = ((DataNode_t*)nodep)->data[0];
+    if(head & 0x1) {
+        return NODE_TYPE_TRAVEL;
+    }
+    return (head == 0) ? NODE_TYPE_DATA : NODE_TYPE_PACKED;
 }
 static bool trie__data_node_is_full(DataNode_t* nodep) {
     return nodep->data[0] == 0 ? false : true;
 }
 
-static uint64_t* trie__get_count_node_bucket(CountNode_t* nodep, uint16_t value) {
-    return &nodep->count[IDX_FROM_VALUE(value,TRIE_MAX_DEPTH)];
+#ifdef TRIE_SIMD_SSE2
+/* Number of occupied slots holding something smaller than value, for a non-zero value.
+ * Subtracting one makes the empty slots wrap around to the largest value, and the bias
+ * turns the signed compare into an unsigned one */
+static uint8_t trie__data_node_count_less(const __m128i rows[4], uint16_t value) {
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i limit = _mm_set1_epi16((short)((value - 1) ^ 0x8000));
+    __m128i less[4];
+    for(uint8_t i = 0; i < 4; i++) {
+        less[i] = _mm_cmplt_epi16(_mm_xor_si128(_mm_sub_epi16(rows[i], ones), bias), limit);
+    }
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(less[0], less[1]))
+                  | ((uint32_t)_mm_movemask_epi8(_mm_packs_epi16(less[2], less[3])) << 16);
+    return __builtin_popcount(mask);
+}
+
+/* Insert a non-zero value into a data node that is not full. The slot is found with a
+ * single compare and the elements in front of it are shifted down a lane in registers */
+static void trie__data_node_insert(DataNode_t* nodep, uint16_t value) {
+    __m128i rows[4];
+    for(uint8_t i = 0; i < 4; i++) {
+        rows[i] = _mm_load_si128((const __m128i*)&nodep->data[i*8]);
+    }
+    const __m128i slot = _mm_set1_epi16(31 - trie__data_node_count_less(rows, value));
+    const __m128i new_value = _mm_set1_epi16((short)value);
+    for(uint8_t i = 0; i < 4; i++) {
+        const __m128i lane = _mm_add_epi16(_mm_set_epi16(7,6,5,4,3,2,1,0), _mm_set1_epi16(i*8));
+        /* shifted holds data[lane+1] */
+        __m128i shifted = _mm_srli_si128(rows[i], 2);
+        if(i < 3) {
+            shifted = _mm_or_si128(shifted, _mm_slli_si128(rows[i+1], 14));
+        }
+        const __m128i before = _mm_cmplt_epi16(lane, slot);
+        const __m128i at = _mm_cmpeq_epi16(lane, slot);
+        __m128i row = _mm_or_si128(_mm_and_si128(before, shifted), _mm_and_si128(at, new_value));
+        row = _mm_or_si128(row, _mm_andnot_si128(_mm_or_si128(before, at), rows[i]));
+        _mm_store_si128((__m128i*)&nodep->data[i*8], row);
+    }
+}
+
+static uint64_t trie__count_data_node(DataNode_t* nodep, uint16_t value) {
+    const __m128i needle = _mm_set1_epi16((short)value);
+    uint32_t mask = 0;
+    for(uint8_t i = 0; i < 4; i += 2) {
+        __m128i lo = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)&nodep->data[i*8]), needle);
+        __m128i hi = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)&nodep->data[(i+1)*8]), needle);
+        mask |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << (i*8);
+    }
+    return __builtin_popcount(mask);
+}
+#else
+static void trie__data_node_insert(DataNode_t* nodep, uint16_t value) {
+    uint16_t* current_elemp = &nodep->data[31];
+    while(*current_elemp != 0 && *current_elemp < value) {
+        /* This will not happen because the last element will 
+         * always be 0 at this point */
+        assert(current_elemp != &nodep->data[0]);
+        --current_elemp;
+    }
+    if(*current_elemp == 0) {
+        *current_elemp = value;
+    } else {
+        /* We need to insert into the middle of the array, so move everything after
+         * us down by one element */
+        memmove(&nodep->data[0], &nodep->data[1], (uint8_t*)current_elemp - (uint8_t*)nodep->data);
+        *current_elemp = value;
+    }
+}
+
+static uint64_t trie__count_data_node(DataNode_t* nodep, uint16_t value) {
+    /* The slots are sorted with the smallest value in data[31], so stop at the first larger one */
+    uint64_t count = 0;
+    uint16_t* current_elemp = &nodep->data[31];
+    while( current_elemp != (&nodep->data[0])-1 && *current_elemp != 0 && *current_elemp <= value ) {
+        count += (*current_elemp == value);
+        --current_elemp;
+    }
+    return count;
+}
+#endif
+
+static uint8_t trie__data_node_free_slots(DataNode_t* nodep) {
+    uint8_t free_slots = 0;
+    while(free_slots < NELEMS(nodep->data) && nodep->data[free_slots] == 0) {
+        ++free_slots;
+    }
+    return free_slots;
+}
+
+/* Insert n copies of a non-zero value, n must be at most the number of free slots */
+static void trie__data_node_insert_n(DataNode_t* nodep, uint16_t value, uint8_t n) {
+    uint8_t first_used = trie__data_node_free_slots(nodep);
+    assert(n <= first_used);
+    /* The copies go right in front of the first element that is not smaller */
+    uint8_t slot = NELEMS(nodep->data);
+    while(slot > first_used && nodep->data[slot-1] < value) {
+        --slot;
+    }
+    /* Slide data[first_used, slot) down by n and fill the gap */
+    memmove(&nodep->data[first_used - n], &nodep->data[first_used], (slot - first_used) * sizeof(nodep->data[0]));
+    for(uint8_t i = slot - n; i < slot; i++) {
+        nodep->data[i] = value;
+    }
+}
+
+/* Count nodes may be packed, so their buckets are only ever reached through here */
+static uint64_t* trie__get_count_node_bucket(Node_t* nodep, uint16_t value) {
+    return &((uint64_t*)nodep)[IDX_FROM_VALUE(value,TRIE_MAX_DEPTH)];
+}
+
+/* The first subnode of a compact travel node */
+static Node_t* trie__compact_slab(struct sTrieArenaChunk* const* chunk_tablep, const CompactTravelNode_t* nodep) {
+    uint32_t index = nodep->slab >> 1;
+    uint8_t* chunkp = (uint8_t*)chunk_tablep[index >> TRIE_COMPACT_LINE_BITS];
+    return (Node_t*)(chunkp + (size_t)(index & ((1u << TRIE_COMPACT_LINE_BITS) - 1)) * CACHE_LINE_SIZE);
+}
+
+/* Subnode idx of the travel node at depth */
+static Node_t* trie__travel_link(struct sTrie* triep, TravelNode_t* nodep, uint8_t depth, uint8_t idx) {
+    if(triep->config.compact_links) {
+        return trie__slab_child(trie__compact_slab(triep->chunk_table, (CompactTravelNode_t*)nodep), depth, idx);
+    }
+    return UNTAG_PTR(nodep->link[idx]);
+}
+
+static Node_t* trie__follow_travel_node(struct sTrie* triep, TravelNode_t* nodep, uint8_t depth, uint16_t value) {
+    return trie__travel_link(triep, nodep, depth, IDX_FROM_VALUE(value,depth));
+}
+
+/* Only valid for a counted trie without compact links. The concurrent inserts need the
+ * totals as plain words they can add to atomically */
+static uint64_t* trie__travel_node_counts(TravelNode_t* nodep) {
+    return trie__slab_counts(UNTAG_PTR(nodep->link[0]));
+}
+
+/* The totals of a compact travel node are read and written 8 bytes at a time. The last
+ * byte of the word belongs to the next total, or to the padding after the last one,
+ * and only changes if a total overflows its 56 bits */
+static uint64_t trie__compact_total(const CompactTravelNode_t* nodep, uint8_t idx) {
+    uint64_t word;
+    memcpy(&word, &nodep->totals[idx * TRIE_COMPACT_TOTAL_BYTES], sizeof(word));
+    return word & TRIE_COMPACT_TOTAL_MASK;
+}
+
+static void trie__compact_total_add(CompactTravelNode_t* nodep, uint8_t idx, uint64_t n) {
+    uint64_t word;
+    memcpy(&word, &nodep->totals[idx * TRIE_COMPACT_TOTAL_BYTES], sizeof(word));
+    assert((word & TRIE_COMPACT_TOTAL_MASK) + n <= TRIE_COMPACT_TOTAL_MASK);
+    word += n;
+    memcpy(&nodep->totals[idx * TRIE_COMPACT_TOTAL_BYTES], &word, sizeof(word));
+}
+
+static void trie__compact_total_sub(CompactTravelNode_t* nodep, uint8_t idx, uint64_t n) {
+    uint64_t word;
+    memcpy(&word, &nodep->totals[idx * TRIE_COMPACT_TOTAL_BYTES], sizeof(word));
+    assert((word & TRIE_COMPACT_TOTAL_MASK) >= n);
+    word -= n;
+    memcpy(&nodep->totals[idx * TRIE_COMPACT_TOTAL_BYTES], &word, sizeof(word));
+}
+
+/* Add n to link total idx of a counted trie */
+static void trie__link_total_add(struct sTrie* triep, TravelNode_t* nodep, uint8_t idx, uint64_t n) {
+    if(triep->config.compact_links) {
+        trie__compact_total_add((CompactTravelNode_t*)nodep, idx, n);
+    } else {
+        trie__travel_node_counts(nodep)[idx] += n;
+    }
+}
+
+static void trie__link_total_sub(struct sTrie* triep, TravelNode_t* nodep, uint8_t idx, uint64_t n) {
+    if(triep->config.compact_links) {
+        trie__compact_total_sub((CompactTravelNode_t*)nodep, idx, n);
+    } else {
+        trie__travel_node_counts(nodep)[idx] -= n;
+    }
+}
+
+/* Turn destp into a travel node at depth over slab. totalsp holds the link totals of a
+ * counted trie, NULL leaves them at 0. link[0] goes out last with release semantics,
+ * so a concurrent reader that sees the travel node also sees its subnodes and totals */
+static void trie__write_travel_node(struct sTrie* triep, TravelNode_t* destp, TrieSlab_t slab, uint8_t depth, const uint64_t* totalsp) {
+    if(triep->config.compact_links) {
+        CompactTravelNode_t node;
+        bzero(&node, sizeof(node));
+        node.slab = (slab.index << 1) | 0x1;
+        for(uint8_t i = 0; triep->config.counted && totalsp != NULL && i < NELEMS(destp->link); i++) {
+            trie__compact_total_add(&node, i, totalsp[i]);
+        }
+        *(CompactTravelNode_t*)destp = node;
+        return;
+    }
+    if(triep->config.counted && totalsp != NULL) {
+        memcpy(trie__slab_counts(slab.nodes), totalsp, NELEMS(destp->link) * sizeof(*totalsp));
+    }
+    for(uint8_t i = NELEMS(destp->link) - 1; i > 0; i--) {
+        destp->link[i] = TAG_PTR(trie__slab_child(slab.nodes, depth, i));
+    }
+    __atomic_store_n(&destp->link[0], TAG_PTR(slab.nodes), __ATOMIC_RELEASE);
+}
+
+static uint16_t* trie__packed_node_counter(PackedNode_t* nodep, uint16_t value) {
+    return &nodep->count[value & (NELEMS(nodep->count) - 1)];
+}
+
+/* Compact tries burst the last data nodes into packed nodes. Nothing in a data node can
+ * overflow a 16 bit counter */
+static void trie__pack_data_node(DataNode_t* nodep, Node_t* destp) {
+    DataNode_t elements = *nodep;
+    bzero(destp, sizeof(*destp));
+    for(uint8_t i = 0; i < NELEMS(elements.data); i++) {
+        ++(*trie__packed_node_counter(&destp->packed, elements.data[i]));
+    }
+    destp->packed.marker = TRIE_PACKED_NODE_MARKER;
 }
 
-static Node_t* trie__follow_travel_node(TravelNode_t* nodep, uint8_t depth, uint16_t value) {
-    return UNTAG_PTR(nodep->link[IDX_FROM_VALUE(value,depth)]);
+/* Turn the packed node covering value into a travel node over 64 bit count nodes, once one
+ * of its counters can't take any more */
+static void trie__promote_packed_node(struct sTrie* triep, Node_t* nodep, uint16_t value) {
+    const uint8_t depth = TRIE_MAX_DEPTH - 1;
+    PackedNode_t packed = nodep->packed;
+    uint16_t first_value = value & ~(uint16_t)(NELEMS(packed.count) - 1);
+    uint64_t totals[NELEMS(nodep->travel.link)] = {0};
+    TrieSlab_t slab = trie__alloc_slab(triep, value, depth);
+    for(uint8_t i = 0; i < NELEMS(packed.count); i++) {
+        uint16_t current = first_value + i;
+        uint8_t idx = IDX_FROM_VALUE(current,depth);
+        *trie__get_count_node_bucket(trie__slab_child(slab.nodes, depth, idx), current) = packed.count[i];
+        totals[idx] += packed.count[i];
+    }
+    trie__write_travel_node(triep, &nodep->travel, slab, depth, totals);
+    TRIE_STAT_ADD(triep, promotions, 1);
 }
 
-/* This happens when a data node is full and we need to transform it into a travel node */
-static void trie__burst_data_node(DataNode_t* nodep, uint8_t current_depth) {
+/* This happens when a data node is full and we need to transform it into a travel node.
+ * The elements are read from nodep and the links are written to destp, which is usually
+ * the same node. The links are written last, see trie__write_travel_node. */
+static void trie__burst_data_node_into(struct sTrie* triep, DataNode_t* nodep, TravelNode_t* destp, uint8_t current_depth) {
     /* This is set if the subnode needs to be re-bursted */
     DataNode_t* node_to_burst = NULL;
+    TRIE_STAT_ADD(triep, bursts[current_depth], 1);
+    if(current_depth == TRIE_MAX_DEPTH - 1 && triep->config.compact_counts) {
+        trie__pack_data_node(nodep, (Node_t*)destp);
+        return;
+    }
     /* Allocate all the memory we know we are going to need as a slab */
-    Node_t* all_new_nodesp = (Node_t*)aligned_alloc(CACHE_LINE_SIZE,sizeof(*all_new_nodesp)*NELEMS(((TravelNode_t*)nodep)->link));
-    if(all_new_nodesp == NULL) {
-        assert(!"Travel Node allocation failed");
+    /* Every element of a full data node shares the prefix of the node */
+    TrieSlab_t slab = trie__alloc_slab(triep, nodep->data[31], current_depth);
+    Node_t* all_new_nodesp = slab.nodes;
+    uint64_t totals[NELEMS(destp->link)] = {0};
+    if(triep->config.counted) {
+        /* Every element lands under exactly one link, so the totals are known up front */
+        for(uint8_t i = 0; i < NELEMS(nodep->data); i++) {
+            ++totals[IDX_FROM_VALUE(nodep->data[i],current_depth)];
+        }
     }
-    bzero(all_new_nodesp, sizeof(*all_new_nodesp)*NELEMS(((TravelNode_t*)nodep)->link));
     /* Copy the data into the correct subnodes and transform current node into a travel node */
     if ( current_depth == TRIE_MAX_DEPTH - 1 ) {
         /* Subbuckets will be counting buckets */
         uint16_t* current_elemp = (uint16_t*)&nodep->data[31];
         while(current_elemp != ((&nodep->data[0])-1)) {
-            ++(*trie__get_count_node_bucket(&all_new_nodesp[IDX_FROM_VALUE(*current_elemp,current_depth)].count, *current_elemp));
+            ++(*trie__get_count_node_bucket(trie__slab_child(all_new_nodesp, current_depth, IDX_FROM_VALUE(*current_elemp,current_depth)), *current_elemp));
             --current_elemp;
         }
     } else { /* subbuckets are data nodes */
+        /* The elements come out smallest first, so each one can simply be appended to its
+         * subnode without searching for its slot */
+        uint8_t fill[NELEMS(((TravelNode_t*)nodep)->link)] = {0};
         uint16_t* current_elemp = (uint16_t*)&nodep->data[31];
         while(current_elemp != ((&nodep->data[0])-1)) {
-            uint16_t* elem_to_insert_atp = &all_new_nodesp[IDX_FROM_VALUE(*current_elemp,current_depth)].data.data[31];
-            while(*elem_to_insert_atp != 0 && *elem_to_insert_atp <= *current_elemp) {
-                --elem_to_insert_atp;
-            }
+            uint8_t idx = IDX_FROM_VALUE(*current_elemp,current_depth);
+            uint16_t* elem_to_insert_atp = &all_new_nodesp[idx].data.data[31 - fill[idx]++];
             *elem_to_insert_atp = *current_elemp;
-            if(elem_to_insert_atp == &all_new_nodesp[IDX_FROM_VALUE(*current_elemp,current_depth)].data.data[0]) {
+            if(elem_to_insert_atp == &all_new_nodesp[idx].data.data[0]) {
                 /* We have to burst all the way down
                  * Since we only bursted a single node, this case only happens if all the elementes burst out
                  * into the same node. Therefore, we only have to worry about bursting that specific node 
                  * so we just record it here */
-                node_to_burst = &all_new_nodesp[IDX_FROM_VALUE(*current_elemp,current_depth)].data;
+                node_to_burst = &all_new_nodesp[idx].data;
             }
             --current_elemp;
         }
     }
-    for(uint8_t i=0; i<NELEMS(((TravelNode_t*)nodep)->link); i++) {
-        ((TravelNode_t*)nodep)->link[i] = TAG_PTR(&all_new_nodesp[i]);
-    }
     if(node_to_burst != NULL) {
-        /* This tail recursive call is not ideal, but it does simplify the logic. 
+        /* This recursive call is not ideal, but it does simplify the logic. 
          * A loop would be better, but this is a rare/pathological case so i'm
-         * not very worried */
-        trie__burst_data_node(node_to_burst, current_depth+1);
+         * not very worried. It has to happen before the slab is published so
+         * nobody ever sees a full data node. */
+        TRIE_STAT_ADD(triep, cascading_bursts, 1);
+        trie__burst_data_node_into(triep, node_to_burst, (TravelNode_t*)node_to_burst, current_depth+1);
     }
+    trie__write_travel_node(triep, destp, slab, current_depth, totals);
+}
+
+static void trie__burst_data_node(struct sTrie* triep, DataNode_t* nodep, uint8_t current_depth) {
+    trie__burst_data_node_into(triep, nodep, (TravelNode_t*)nodep, current_depth);
 }
     
-static void trie__free_subtrie(Node_t* nodep, uint8_t depth) {
-    switch(trie__determine_node_type(nodep, depth)) {
-    case NODE_TYPE_DATA:
-    case NODE_TYPE_COUNT:
-        break;
-    case NODE_TYPE_TRAVEL:
-        trie__free_subtrie(UNTAG_PTR(nodep->travel.link[7]), depth+1);
-        trie__free_subtrie(UNTAG_PTR(nodep->travel.link[6]), depth+1);
-        trie__free_subtrie(UNTAG_PTR(nodep->travel.link[5]), depth+1);
-        trie__free_subtrie(UNTAG_PTR(nodep->travel.link[4]), depth+1);
-        trie__free_subtrie(UNTAG_PTR(nodep->travel.link[3]), depth+1);
-        trie__free_subtrie(UNTAG_PTR(nodep->travel.link[2]), depth+1);
-        trie__free_subtrie(UNTAG_PTR(nodep->travel.link[1]), depth+1);
-        trie__free_subtrie(UNTAG_PTR(nodep->travel.link[0]), depth+1);
-        free(UNTAG_PTR(nodep->travel.link[0]));
-        break;
-    default:
-        assert(!"Unexpected NODE_TYPE");
+static uint64_t trie__count_data_node_range(DataNode_t* nodep, uint16_t lo, uint16_t hi) {
+    uint64_t count = 0;
+    uint16_t* current_elemp = &nodep->data[31];
+    while( current_elemp != (&nodep->data[0])-1 && *current_elemp != 0 && *current_elemp <= hi ) {
+        count += (*current_elemp >= lo);
+        --current_elemp;
     }
+    return count;
 }
-    
-static void trie__print_count_node(FILE* fp, CountNode_t* nodep, uint16_t value) {
-    for(uint64_t i = *trie__get_count_node_bucket(nodep, value); i>0; i--) {
-        fprintf(fp,"%u ", value);
+
+/* Number of values covered by a node at depth. Only 2 of the count node buckets are used */
+#define TRIE_SPAN_AT_DEPTH(__depth) \
+    ( (uint32_t)0x10000 >> ((__depth)*MASK_N_BITS) )
+
+/* The query helpers read both live tries and images. In an image the links are byte
+ * offsets from the start of its node array, a live trie is the special case where the
+ * links are offsets from address 0. A live trie with compact links resolves them
+ * through its chunk table instead */
+typedef struct {
+    uintptr_t link_base;
+    struct sTrieArenaChunk* const* chunk_table;
+    bool counted;
+    /* Where the link totals are, in nodes from the first subnode */
+    int8_t counts_offset;
+} TrieReader_t;
+
+static TrieReader_t trie__reader(struct sTrie* triep) {
+    TrieReader_t reader = { .link_base = 0, .counted = triep->config.counted, .counts_offset = -1 };
+    if(triep->config.compact_links) {
+        reader.chunk_table = triep->chunk_table;
     }
+    return reader;
 }
-static void trie__print_data_node(FILE* fp, DataNode_t* nodep) {
-    uint16_t* current_elemp = &nodep->data[31];
-    while( current_elemp != (&nodep->data[0])-1 && *current_elemp != 0 ) {
-        fprintf(fp,"%u ",*current_elemp);
-        --current_elemp;
+
+static Node_t* trie__reader_link(const TrieReader_t* readerp, TravelNode_t* nodep, uint8_t depth, uint8_t idx) {
+    if(readerp->chunk_table != NULL) {
+        return trie__slab_child(trie__compact_slab(readerp->chunk_table, (CompactTravelNode_t*)nodep), depth, idx);
     }
+    return (Node_t*)(readerp->link_base + (uintptr_t)UNTAG_PTR(nodep->link[idx]));
 }
-    
-static void trie__print_subtrie(FILE* fp, Node_t* nodep, uint16_t value, uint8_t depth) {
-    /* We need to accumulate the value as we walk the tree because count buckets don't
-     *  actually store the value */
+
+static uint64_t trie__reader_total(const TrieReader_t* readerp, TravelNode_t* nodep, uint8_t idx) {
+    if(readerp->chunk_table != NULL) {
+        return trie__compact_total((CompactTravelNode_t*)nodep, idx);
+    }
+    return ((CountNode_t*)(readerp->link_base + (uintptr_t)UNTAG_PTR(nodep->link[0])) + readerp->counts_offset)->count[idx];
+}
+
+static uint64_t trie__count_subtrie_value(const TrieReader_t* readerp, Node_t* nodep, uint16_t value) {
+    uint8_t current_depth = 0;
+    while(trie__determine_node_type(nodep,current_depth) == NODE_TYPE_TRAVEL) {
+        nodep = trie__reader_link(readerp, &nodep->travel, current_depth, IDX_FROM_VALUE(value,current_depth));
+        ++current_depth;
+    }
+    switch(trie__determine_node_type(nodep,current_depth)) {
+    case NODE_TYPE_COUNT:
+        return *trie__get_count_node_bucket(nodep, value);
+    case NODE_TYPE_PACKED:
+        return *trie__packed_node_counter(&nodep->packed, value);
+    default:
+        return trie__count_data_node(&nodep->data, value);
+    }
+}
+
+static uint64_t trie__count_subtrie_range(const TrieReader_t* readerp, Node_t* nodep, uint16_t value, uint8_t depth, uint16_t lo, uint16_t hi) {
+    /* value is the smallest value this subtrie can hold, accumulated the same way
+     * the iterator does it */
+    uint64_t count = 0;
     switch(trie__determine_node_type(nodep, depth)) {
     case NODE_TYPE_COUNT:
-        trie__print_count_node(fp,(CountNode_t*)nodep,value);
-        trie__print_count_node(fp,(CountNode_t*)nodep,value+1);
+        if(value >= lo && value <= hi) {
+            count += *trie__get_count_node_bucket(nodep, value);
+        }
+        if(value+1 >= lo && value+1 <= hi) {
+            count += *trie__get_count_node_bucket(nodep, value+1);
+        }
+        break;
+    case NODE_TYPE_PACKED:
+        for(uint8_t i = 0; i < NELEMS(nodep->packed.count); i++) {
+            if(value + i >= lo && value + i <= hi) {
+                count += nodep->packed.count[i];
+            }
+        }
         break;
     case NODE_TYPE_DATA:
-        trie__print_data_node(fp,(DataNode_t*)nodep);
+        count += trie__count_data_node_range((DataNode_t*)nodep, lo, hi);
         break;
     case NODE_TYPE_TRAVEL:
-        trie__print_subtrie(fp, UNTAG_PTR(nodep->travel.link[0]), value + ((uint16_t)0x0000>>(depth*MASK_N_BITS)), depth+1);
-        trie__print_subtrie(fp, UNTAG_PTR(nodep->travel.link[1]), value + ((uint16_t)0x2000>>(depth*MASK_N_BITS)), depth+1);
-        trie__print_subtrie(fp, UNTAG_PTR(nodep->travel.link[2]), value + ((uint16_t)0x4000>>(depth*MASK_N_BITS)), depth+1);
-        trie__print_subtrie(fp, UNTAG_PTR(nodep->travel.link[3]), value + ((uint16_t)0x6000>>(depth*MASK_N_BITS)), depth+1);
-        trie__print_subtrie(fp, UNTAG_PTR(nodep->travel.link[4]), value + ((uint16_t)0x8000>>(depth*MASK_N_BITS)), depth+1);
-        trie__print_subtrie(fp, UNTAG_PTR(nodep->travel.link[5]), value + ((uint16_t)0xA000>>(depth*MASK_N_BITS)), depth+1);
-        trie__print_subtrie(fp, UNTAG_PTR(nodep->travel.link[6]), value + ((uint16_t)0xC000>>(depth*MASK_N_BITS)), depth+1);
-        trie__print_subtrie(fp, UNTAG_PTR(nodep->travel.link[7]), value + ((uint16_t)0xE000>>(depth*MASK_N_BITS)), depth+1);
+        for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+            uint32_t child_lo = value + ((uint32_t)i << GEN_SHIFT(depth));
+            uint32_t child_hi = child_lo + TRIE_SPAN_AT_DEPTH(depth+1) - 1;
+            if(child_hi < lo || child_lo > hi) {
+                continue;
+            }
+            if(readerp->counted && child_lo >= lo && child_hi <= hi) {
+                /* The whole subtrie is in range, so the link total is the answer */
+                count += trie__reader_total(readerp, &nodep->travel, i);
+                continue;
+            }
+            count += trie__count_subtrie_range(readerp, trie__reader_link(readerp, &nodep->travel, depth, i), (uint16_t)child_lo, depth+1, lo, hi);
+        }
         break;
     default:
         assert(!"Unexpected NODE_TYPE");
     }
+    return count;
+}
+
+/* Find the value at 0 based position k of the sorted subtrie. k must be smaller than
+ * the number of values stored in the subtrie */
+static uint16_t trie__select_subtrie(const TrieReader_t* readerp, Node_t* nodep, uint16_t value, uint8_t depth, uint64_t k) {
+    while(trie__determine_node_type(nodep, depth) == NODE_TYPE_TRAVEL) {
+        uint8_t i = 0;
+        for(; i < NELEMS(nodep->travel.link) - 1; i++) {
+            uint32_t child_lo = value + ((uint32_t)i << GEN_SHIFT(depth));
+            uint64_t child_count = readerp->counted
+                ? trie__reader_total(readerp, &nodep->travel, i)
+                : trie__count_subtrie_range(readerp, trie__reader_link(readerp, &nodep->travel, depth, i), (uint16_t)child_lo, depth+1,
+                                            (uint16_t)child_lo, (uint16_t)(child_lo + TRIE_SPAN_AT_DEPTH(depth+1) - 1));
+            if(k < child_count) {
+                break;
+            }
+            k -= child_count;
+        }
+        value += ((uint16_t)i << GEN_SHIFT(depth));
+        nodep = trie__reader_link(readerp, &nodep->travel, depth, i);
+        ++depth;
+    }
+    if(trie__determine_node_type(nodep, depth) == NODE_TYPE_COUNT) {
+        return (k < *trie__get_count_node_bucket(nodep, value)) ? value : value+1;
+    }
+    if(trie__determine_node_type(nodep, depth) == NODE_TYPE_PACKED) {
+        uint8_t i = 0;
+        while(k >= nodep->packed.count[i]) {
+            k -= nodep->packed.count[i++];
+            assert(i < NELEMS(nodep->packed.count));
+        }
+        return value + i;
+    }
+    assert(k < NELEMS(nodep->data.data) && nodep->data.data[31-k] != 0);
+    return nodep->data.data[31-k];
+}
+
+static uint16_t trie__quantile(const TrieReader_t* readerp, Node_t* base_nodep, uint64_t number_of_zeros, double q) {
+    uint64_t total = number_of_zeros + trie__count_subtrie_range(readerp, base_nodep, 0, 0, 0, USHRT_MAX);
+    if(total == 0) {
+        return 0;
+    }
+    /* Nearest rank: the smallest value with at least ceil(q*total) values at or below it */
+    q = (q > 1.0) ? 1.0 : (q > 0.0) ? q : 0.0;
+    double target = q * (double)total;
+    uint64_t rank = (uint64_t)target;
+    if((double)rank < target) {
+        ++rank;
+    }
+    rank = (rank == 0) ? 1 : (rank > total) ? total : rank;
+    uint64_t k = rank - 1;
+    if(k < number_of_zeros) {
+        return 0;
+    }
+    return trie__select_subtrie(readerp, base_nodep, 0, 0, k - number_of_zeros);
+}
+
+/* Burst the subtrie at nodep as if it had filled up, until it reaches the direct
+ * levels, and record the empty data nodes it ends in. pathpp holds the travel nodes
+ * on the way from the base node so far */
+static void trie__build_direct_levels(struct sTrie* triep, Node_t* nodep, uint16_t value, uint8_t depth, Node_t** pathpp) {
+    if(depth == triep->config.direct_levels) {
+        size_t idx = value >> GEN_SHIFT(depth-1);
+        triep->direct[idx] = nodep;
+        if(triep->config.counted) {
+            memcpy(&triep->direct_path[idx * depth], pathpp, depth * sizeof(*pathpp));
+        }
+        return;
+    }
+    /* The travel nodes are already there when trie_compact has copied them */
+    if(trie__determine_node_type(nodep, depth) != NODE_TYPE_TRAVEL) {
+        TrieSlab_t slab = trie__alloc_slab(triep, value, depth);
+        trie__write_travel_node(triep, &nodep->travel, slab, depth, NULL);
+    }
+    pathpp[depth] = nodep;
+    for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+        trie__build_direct_levels(triep, trie__travel_link(triep, &nodep->travel, depth, i), value + ((uint16_t)i << GEN_SHIFT(depth)), depth+1, pathpp);
+    }
+}
+
+/* Bump the link totals on the way down to direct subtrie idx, for a counted trie */
+static void trie__direct_path_add(struct sTrie* triep, size_t idx, uint16_t value, uint64_t n) {
+    uint8_t levels = triep->config.direct_levels;
+    for(uint8_t i = 0; i < levels; i++) {
+        trie__link_total_add(triep, &triep->direct_path[idx * levels + i]->travel, IDX_FROM_VALUE(value,i), n);
+    }
+}
+
+/* Index of the direct table entry the walk for value starts from */
+static size_t trie__direct_index(struct sTrie* triep, uint16_t value) {
+    return value >> GEN_SHIFT(triep->config.direct_levels-1);
+}
+
+/* Hot values
+ * A hit bumps the pending count of the slot and its hit score. Every few misses move
+ * the clock hand one slot on: a slot with a score loses a point and stays, one without
+ * is handed to the missed value. The missed insert itself still goes into the trie, so
+ * a value only makes it into the table by coming back. Moving the hand on every miss
+ * costs more than the hits save unless nearly every insert hits */
+#ifdef TRIE_SIMD_SSE2
+static int trie__hot_slot(const TrieHotValues_t* hotp, uint16_t value) {
+    const __m128i needle = _mm_set1_epi16((short)value);
+    __m128i lo = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)&hotp->value[0]), needle);
+    __m128i hi = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)&hotp->value[8]), needle);
+    uint32_t mask = _mm_movemask_epi8(_mm_packs_epi16(lo, hi));
+    return (mask != 0) ? __builtin_ctz(mask) : -1;
+}
+#else
+static int trie__hot_slot(const TrieHotValues_t* hotp, uint16_t value) {
+    for(int i = 0; i < TRIE_HOT_VALUES; i++) {
+        if(hotp->value[i] == value) {
+            return i;
+        }
+    }
+    return -1;
+}
+#endif
+
+static void trie__hot_flush_slot(struct sTrie* triep, uint8_t slot) {
+    if(triep->hot.pending[slot] > 0) {
+        trie_insert_value_n(triep, triep->hot.value[slot], triep->hot.pending[slot]);
+        triep->hot.pending[slot] = 0;
+    }
+}
+
+/* Everything that reads the trie calls this first */
+static void trie__hot_flush(struct sTrie* triep) {
+    for(uint8_t i = 0; triep->config.hot_values && i < TRIE_HOT_VALUES; i++) {
+        trie__hot_flush_slot(triep, i);
+    }
+}
+
+void trie_flush(struct sTrie* triep) {
+    trie__hot_flush(triep);
+}
+
+/* Counts a non-zero value if it is hot. Returns false if the caller has to insert it */
+static bool trie__hot_insert(struct sTrie* triep, uint16_t value) {
+    int slot = trie__hot_slot(&triep->hot, value);
+    if(slot >= 0) {
+        if(triep->hot.pending[slot] == UINT16_MAX) {
+            trie__hot_flush_slot(triep, slot);
+        }
+        ++triep->hot.pending[slot];
+        triep->hot_hits[slot] += (triep->hot_hits[slot] < UINT8_MAX);
+        TRIE_STAT_ADD(triep, hot_hits, 1);
+        return true;
+    }
+    if(++triep->hot_misses % TRIE_HOT_MISS_SAMPLE != 0) {
+        return false;
+    }
+    uint8_t hand = triep->hot_hand;
+    triep->hot_hand = (hand + 1) % TRIE_HOT_VALUES;
+    if(triep->hot_hits[hand] > 0) {
+        --triep->hot_hits[hand];
+    } else {
+        trie__hot_flush_slot(triep, hand);
+        triep->hot.value[hand] = value;
+    }
+    return false;
 }
 
 /* Public functions */
 struct sTrie* trie_init(void) {
+    return trie_init_ex(NULL);
+}
+
+struct sTrie* trie_init_ex(const struct sTrieConfig* configp) {
     Node_t* base_nodep;
-    struct sTrie* triep = calloc(sizeof(struct sTrie), 1);
-    trie__alloc_node(&base_nodep);
+    if(configp != NULL && (configp->direct_levels > TRIE_DIRECT_LEVELS_MAX ||
+                           ((configp->compact_counts || configp->compact_links || configp->hot_values) && configp->concurrent))) {
+        return NULL;
+    }
+    /* The hot value table has to sit in a cache line of its own */
+    struct sTrie* triep = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct sTrie));
+    assert(triep != NULL);
+    bzero(triep, sizeof(*triep));
+    if(configp != NULL) {
+        triep->config = *configp;
+    }
+    trie__alloc_node(triep, &base_nodep);
     triep->base_node = base_nodep;
     triep->number_of_zeros = 0;
+    if(triep->config.direct_levels > 0) {
+        Node_t* pathp[TRIE_DIRECT_LEVELS_MAX] = {0};
+        size_t roots = (size_t)1 << (MASK_N_BITS * triep->config.direct_levels);
+        triep->direct = calloc(roots, sizeof(*triep->direct));
+        assert(triep->direct != NULL);
+        if(triep->config.counted) {
+            triep->direct_path = calloc(roots * triep->config.direct_levels, sizeof(*triep->direct_path));
+            assert(triep->direct_path != NULL);
+        }
+        trie__build_direct_levels(triep, triep->base_node, 0, 0, pathp);
+    }
     return triep;
 }
 
 void trie_free(struct sTrie** triepp) {
-    trie__free_subtrie((*triepp)->base_node, 0);
-    free((*triepp)->base_node);
+    /* Every node lives in the arena, so there is no need to walk the trie */
+    trie__arena_free(&(*triepp)->arena);
+    for(uint8_t i = 0; i < NELEMS((*triepp)->lanes); i++) {
+        trie__arena_free(&(*triepp)->lanes[i]);
+    }
+    free((*triepp)->direct);
+    free((*triepp)->direct_path);
+    free((*triepp)->chunk_table);
     free(*triepp);
     *triepp = NULL;
 }
 
-void trie_print_values(struct sTrie* triep, FILE* fp) {
-    for(uint64_t i = triep->number_of_zeros; i > 0; i--) {
-        fprintf(fp,"0 ");
+/* Tries handed to trie_free_async wait on a list for a single reclaimer thread, which
+ * is started by the first of them */
+static pthread_mutex_t trie_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trie_reclaim_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t trie_reclaim_done = PTHREAD_COND_INITIALIZER;
+static struct sTrie* trie_reclaim_list;
+static size_t trie_reclaim_pending;
+static bool trie_reclaim_started;
+
+static void* trie__reclaimer(void* argp) {
+    (void)argp;
+    pthread_mutex_lock(&trie_reclaim_lock);
+    for(;;) {
+        while(trie_reclaim_list == NULL) {
+            pthread_cond_wait(&trie_reclaim_work, &trie_reclaim_lock);
+        }
+        struct sTrie* triep = trie_reclaim_list;
+        trie_reclaim_list = NULL;
+        pthread_mutex_unlock(&trie_reclaim_lock);
+        size_t freed = 0;
+        while(triep != NULL) {
+            struct sTrie* nextp = triep->reclaim_next;
+            trie_free(&triep);
+            triep = nextp;
+            ++freed;
+        }
+        pthread_mutex_lock(&trie_reclaim_lock);
+        trie_reclaim_pending -= freed;
+        pthread_cond_broadcast(&trie_reclaim_done);
     }
-    trie__print_subtrie(fp, triep->base_node, 0, 0);
+    return NULL;
 }
 
-void trie_insert_value(struct sTrie* trie_ctxp, uint16_t value) {
-    if (value == 0) {
-        ++(trie_ctxp->number_of_zeros);
-        return;
+void trie_free_async(struct sTrie** triepp) {
+    struct sTrie* triep = *triepp;
+    *triepp = NULL;
+    pthread_mutex_lock(&trie_reclaim_lock);
+    if(!trie_reclaim_started) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, trie__reclaimer, NULL) != 0) {
+            /* No thread to hand it to, so free it here after all */
+            pthread_mutex_unlock(&trie_reclaim_lock);
+            trie_free(&triep);
+            return;
+        }
+        pthread_detach(thread);
+        trie_reclaim_started = true;
     }
+    triep->reclaim_next = trie_reclaim_list;
+    trie_reclaim_list = triep;
+    ++trie_reclaim_pending;
+    pthread_cond_signal(&trie_reclaim_work);
+    pthread_mutex_unlock(&trie_reclaim_lock);
+}
 
-    uint8_t current_depth = 0;
-    Node_t* current_node = trie_ctxp->base_node;
-    while(trie__determine_node_type(current_node,current_depth) == NODE_TYPE_TRAVEL) {
-        current_node = trie__follow_travel_node((TravelNode_t*)current_node, 
-                                                current_depth++, 
-                                                value);
+void trie_free_async_wait(void) {
+    pthread_mutex_lock(&trie_reclaim_lock);
+    while(trie_reclaim_pending > 0) {
+        pthread_cond_wait(&trie_reclaim_done, &trie_reclaim_lock);
     }
-    if (trie__determine_node_type(current_node,current_depth) == NODE_TYPE_COUNT) {
-        assert(*trie__get_count_node_bucket((CountNode_t*)current_node, value) != USHRT_MAX);
-        /* Simply increment the bucket count and exit */
-        ++(*trie__get_count_node_bucket((CountNode_t*)current_node, value));
-        return;
-    } else {
-        /* We must be NODE_TYPE_DATA */
-        assert(trie__determine_node_type(current_node,current_depth) == NODE_TYPE_DATA);
-        uint16_t* current_elemp = &((DataNode_t*)current_node)->data[31];
-        while(*current_elemp != 0 && *current_elemp < value) {
-            /* This will not happen because the last element will 
-             * always be 0 at this point */
-            assert(current_elemp != &((DataNode_t*)current_node)->data[0]);
-            --current_elemp;
-        }
-        if(*current_elemp == 0) {
-            *current_elemp = value;
-        } else {
-            /* We need to insert into the middle of the array, so move everything after
-             * us down by one element */
-            memmove(&current_node->data.data[0], &current_node->data.data[1], (uint8_t*)current_elemp - (uint8_t*)current_node->data.data);
-            *current_elemp = value;
-        }
-        if(trie__data_node_is_full((DataNode_t*)current_node)) {
-            /* Burst the node here */
-            trie__burst_data_node((DataNode_t*)current_node, current_depth);
-        }
+    pthread_mutex_unlock(&trie_reclaim_lock);
+}
+
+void trie_reset(struct sTrie* triep) {
+    assert(!triep->read_only);
+    trie__arena_reset(&triep->arena);
+    for(uint8_t i = 0; i < NELEMS(triep->lanes); i++) {
+        trie__arena_reset(&triep->lanes[i]);
+    }
+    trie__alloc_node(triep, &triep->base_node);
+    triep->number_of_zeros = 0;
+    memset(&triep->counters, 0, sizeof(triep->counters));
+    memset(triep->free_slabs, 0, sizeof(triep->free_slabs));
+    triep->free_slab_bytes = 0;
+    bzero(&triep->hot, sizeof(triep->hot));
+    bzero(triep->hot_hits, sizeof(triep->hot_hits));
+    triep->hot_hand = 0;
+    if(triep->direct != NULL) {
+        Node_t* pathp[TRIE_DIRECT_LEVELS_MAX] = {0};
+        trie__build_direct_levels(triep, triep->base_node, 0, 0, pathp);
     }
 }
-        
+
+/* An iterator over just the subtrie at nodep, whose smallest value is value */
+static void trie__iter_init_at(TrieIter_t* iterp, struct sTrie* triep, Node_t* nodep, uint16_t value, uint8_t depth) {
+    iterp->trie = triep;
+    iterp->zeros_pending = false;
+    iterp->depth = depth;
+    iterp->top = depth;
+    iterp->node[depth] = nodep;
+    iterp->value[depth] = value;
+    iterp->position[depth] = 0;
+}
+
+/* Printing
+ * The text of a value is formatted once and then copied for each time it was inserted,
+ * doubling the copied run, into a buffer that goes out with one fwrite when full */
+typedef struct {
+    FILE* fp;
+    size_t used;
+    bool failed;
+    char bytes[TRIE_PRINT_BUFFER_SIZE];
+} TriePrintBuffer_t;
+
+static const char trie__digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Writes value and a trailing space, as "%u " does, and returns the length */
+static uint8_t trie__format_value(uint16_t value, char* textp) {
+    char digits[5];
+    uint8_t first = sizeof(digits);
+    while(value >= 100) {
+        first -= 2;
+        memcpy(&digits[first], &trie__digit_pairs[(value % 100) * 2], 2);
+        value /= 100;
+    }
+    if(value >= 10) {
+        first -= 2;
+        memcpy(&digits[first], &trie__digit_pairs[value * 2], 2);
+    } else {
+        digits[--first] = '0' + value;
+    }
+    uint8_t length = sizeof(digits) - first;
+    memcpy(textp, &digits[first], length);
+    textp[length] = ' ';
+    return length + 1;
+}
+
+static void trie__print_flush(TriePrintBuffer_t* bufferp) {
+    if(bufferp->used > 0 && fwrite(bufferp->bytes, bufferp->used, 1, bufferp->fp) != 1) {
+        bufferp->failed = true;
+    }
+    bufferp->used = 0;
+}
+
+static void trie__print_repeat(TriePrintBuffer_t* bufferp, uint16_t value, uint64_t count) {
+    char text[8];
+    uint8_t length = trie__format_value(value, text);
+    while(count > 0) {
+        if(TRIE_PRINT_BUFFER_SIZE - bufferp->used < length) {
+            trie__print_flush(bufferp);
+        }
+        char* runp = &bufferp->bytes[bufferp->used];
+        uint64_t fit = (TRIE_PRINT_BUFFER_SIZE - bufferp->used) / length;
+        size_t run = ((count < fit) ? count : fit) * length;
+        memcpy(runp, text, length);
+        for(size_t copied = length; copied < run; copied *= 2) {
+            memcpy(runp + copied, runp, (run - copied < copied) ? run - copied : copied);
+        }
+        bufferp->used += run;
+        count -= run / length;
+    }
+}
+
+/* Returns -1 if a write failed */
+static int trie__print_iter(TrieIter_t* iterp, FILE* fp) {
+    TriePrintBuffer_t buffer = { .fp = fp };
+    uint16_t value;
+    uint64_t count;
+    while(trie_iter_next(iterp, &value, &count)) {
+        trie__print_repeat(&buffer, value, count);
+    }
+    trie__print_flush(&buffer);
+    return buffer.failed ? -1 : 0;
+}
+
+void trie_print_values(struct sTrie* triep, FILE* fp) {
+    TrieIter_t iter;
+    trie_iter_init(triep, &iter);
+    trie__print_iter(&iter, fp);
+}
+
+/* One subtrie of a parallel print and the text it came out as */
+typedef struct {
+    Node_t* node;
+    uint16_t value;
+    uint8_t depth;
+    char* bytes;
+    size_t size;
+} TriePrintTask_t;
+
+typedef struct {
+    struct sTrie* trie;
+    TriePrintTask_t* tasks;
+    size_t task_count;
+    size_t next_task;
+    bool failed;
+} TriePrintJob_t;
+
+/* The subtries at TRIE_PARALLEL_SPLIT_DEPTH in value order, or whatever stands in
+ * for them higher up */
+static size_t trie__collect_print_tasks(struct sTrie* triep, Node_t* nodep, uint16_t value, uint8_t depth, TriePrintTask_t* tasksp, size_t n) {
+    if(depth < TRIE_PARALLEL_SPLIT_DEPTH && trie__determine_node_type(nodep, depth) == NODE_TYPE_TRAVEL) {
+        for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+            n = trie__collect_print_tasks(triep, trie__travel_link(triep, &nodep->travel, depth, i),
+                                          value + ((uint16_t)i << GEN_SHIFT(depth)), depth+1, tasksp, n);
+        }
+        return n;
+    }
+    tasksp[n] = (TriePrintTask_t){ .node = nodep, .value = value, .depth = depth };
+    return n + 1;
+}
+
+/* Workers take the next task until there are none left, so a worker that drew small
+ * subtries simply does more of them */
+static void* trie__print_worker(void* argp) {
+    TriePrintJob_t* jobp = argp;
+    size_t i;
+    while((i = __atomic_fetch_add(&jobp->next_task, 1, __ATOMIC_RELAXED)) < jobp->task_count) {
+        TriePrintTask_t* taskp = &jobp->tasks[i];
+        FILE* fp = open_memstream(&taskp->bytes, &taskp->size);
+        if(fp == NULL) {
+            __atomic_store_n(&jobp->failed, true, __ATOMIC_RELAXED);
+            continue;
+        }
+        TrieIter_t iter;
+        trie__iter_init_at(&iter, jobp->trie, taskp->node, taskp->value, taskp->depth);
+        bool failed = (trie__print_iter(&iter, fp) != 0);
+        if(fclose(fp) != 0 || failed) {
+            __atomic_store_n(&jobp->failed, true, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+int trie_print_values_parallel(struct sTrie* triep, FILE* fp, unsigned threads) {
+    TriePrintTask_t tasks[1 << (MASK_N_BITS * TRIE_PARALLEL_SPLIT_DEPTH)];
+    TriePrintJob_t job = { .trie = triep, .tasks = tasks };
+    trie__hot_flush(triep);
+    job.task_count = trie__collect_print_tasks(triep, triep->base_node, 0, 0, tasks, 0);
+    if(threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (unsigned)cpus : 1;
+    }
+    threads = (threads > job.task_count) ? job.task_count : threads;
+    /* The calling thread is one of the workers. If a thread can't be started the
+     * others pick up its share */
+    pthread_t* workersp = calloc(threads, sizeof(*workersp));
+    assert(workersp != NULL);
+    unsigned started = 0;
+    for(unsigned i = 1; i < threads; i++) {
+        if(pthread_create(&workersp[started], NULL, trie__print_worker, &job) == 0) {
+            ++started;
+        }
+    }
+    trie__print_worker(&job);
+    for(unsigned i = 0; i < started; i++) {
+        pthread_join(workersp[i], NULL);
+    }
+    free(workersp);
+
+    TriePrintBuffer_t zeros = { .fp = fp };
+    trie__print_repeat(&zeros, 0, triep->number_of_zeros);
+    trie__print_flush(&zeros);
+    job.failed |= zeros.failed;
+    for(size_t i = 0; i < job.task_count; i++) {
+        if(!job.failed && tasks[i].size > 0 && fwrite(tasks[i].bytes, tasks[i].size, 1, fp) != 1) {
+            job.failed = true;
+        }
+        free(tasks[i].bytes);
+    }
+    return (job.failed || ferror(fp)) ? -1 : 0;
+}
+
+static void trie__stats_subtrie(struct sTrie* triep, Node_t* nodep, uint8_t depth, TrieStats_t* statsp, uint64_t* used_slotsp) {
+    switch(trie__determine_node_type(nodep, depth)) {
+    case NODE_TYPE_COUNT:
+        ++statsp->count_nodes;
+        break;
+    case NODE_TYPE_PACKED:
+        ++statsp->packed_nodes;
+        break;
+    case NODE_TYPE_DATA:
+        ++statsp->data_nodes;
+        *used_slotsp += NELEMS(nodep->data.data) - trie__data_node_free_slots(&nodep->data);
+        break;
+    case NODE_TYPE_TRAVEL:
+        ++statsp->travel_nodes;
+        if(triep->config.counted && !triep->config.compact_links) {
+            ++statsp->total_nodes;
+        }
+        for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+            trie__stats_subtrie(triep, trie__travel_link(triep, &nodep->travel, depth, i), depth+1, statsp, used_slotsp);
+        }
+        break;
+    default:
+        assert(false);
+    }
+}
+
+void trie_get_stats(struct sTrie* triep, TrieStats_t* statsp) {
+    uint64_t used_slots = 0;
+    memset(statsp, 0, sizeof(*statsp));
+    trie__hot_flush(triep);
+    trie__stats_subtrie(triep, triep->base_node, 0, statsp, &used_slots);
+    statsp->bytes_reserved = triep->arena.bytes_reserved;
+    statsp->bytes_used = triep->arena.bytes_used;
+    for(uint8_t i = 0; i < NELEMS(triep->lanes); i++) {
+        statsp->bytes_reserved += triep->lanes[i].bytes_reserved;
+        statsp->bytes_used += triep->lanes[i].bytes_used;
+    }
+    statsp->bytes_used -= triep->free_slab_bytes;
+    /* A dense trie can be all travel and count nodes */
+    if(statsp->data_nodes != 0) {
+        statsp->data_fill_factor = (double)used_slots / (double)(statsp->data_nodes * NELEMS(((DataNode_t*)0)->data));
+    }
+#ifdef TRIE_STATS
+    statsp->counters_enabled = true;
+#endif
+    statsp->counters = triep->counters;
+    if(statsp->counters.descents != 0) {
+        statsp->average_descent_depth = (double)statsp->counters.descent_depth_total / (double)statsp->counters.descents;
+    }
+}
+
+void trie_iter_init(struct sTrie* triep, TrieIter_t* iterp) {
+    trie__hot_flush(triep);
+    iterp->trie = triep;
+    iterp->zeros_pending = (triep->number_of_zeros > 0);
+    iterp->depth = 0;
+    iterp->top = 0;
+    iterp->node[0] = triep->base_node;
+    iterp->value[0] = 0;
+    iterp->position[0] = 0;
+}
+
+bool trie_iter_next(TrieIter_t* iterp, uint16_t* valuep, uint64_t* countp) {
+    if(iterp->zeros_pending) {
+        iterp->zeros_pending = false;
+        *valuep = 0;
+        *countp = iterp->trie->number_of_zeros;
+        return true;
+    }
+    /* Each stack level remembers the node, the smallest value it can hold and how far
+     * into it we are: the next link of a travel node, the next bucket of a count or
+     * packed node or the next slot (counted from data[31]) of a data node */
+    while(iterp->depth >= iterp->top) {
+        uint8_t depth = iterp->depth;
+        Node_t* nodep = iterp->node[depth];
+        uint8_t* positionp = &iterp->position[depth];
+        switch(trie__determine_node_type(nodep, depth)) {
+        case NODE_TYPE_TRAVEL:
+            if(*positionp == NELEMS(nodep->travel.link)) {
+                break;
+            }
+            iterp->node[depth+1] = trie__travel_link(iterp->trie, &nodep->travel, depth, *positionp);
+            iterp->value[depth+1] = iterp->value[depth] + ((uint16_t)*positionp << GEN_SHIFT(depth));
+            iterp->position[depth+1] = 0;
+            ++(*positionp);
+            ++(iterp->depth);
+            continue;
+        case NODE_TYPE_COUNT:
+            /* Only the buckets for value and value+1 are used */
+            while(*positionp < TRIE_COUNT_NODE_BUCKETS) {
+                uint16_t value = iterp->value[depth] + *positionp;
+                ++(*positionp);
+                uint64_t count = *trie__get_count_node_bucket(nodep, value);
+                if(count > 0) {
+                    *valuep = value;
+                    *countp = count;
+                    return true;
+                }
+            }
+            break;
+        case NODE_TYPE_PACKED:
+            while(*positionp < NELEMS(nodep->packed.count)) {
+                uint8_t i = (*positionp)++;
+                if(nodep->packed.count[i] != 0) {
+                    *valuep = iterp->value[depth] + i;
+                    *countp = nodep->packed.count[i];
+                    return true;
+                }
+            }
+            break;
+        case NODE_TYPE_DATA:
+            if(*positionp < NELEMS(nodep->data.data) && nodep->data.data[31 - *positionp] != 0) {
+                /* Duplicates sit next to each other, so report them as one run */
+                uint16_t value = nodep->data.data[31 - *positionp];
+                uint64_t count = 0;
+                while(*positionp < NELEMS(nodep->data.data) && nodep->data.data[31 - *positionp] == value) {
+                    ++count;
+                    ++(*positionp);
+                }
+                *valuep = value;
+                *countp = count;
+                return true;
+            }
+            break;
+        default:
+            assert(!"Unexpected NODE_TYPE");
+        }
+        /* This node is exhausted, go back up */
+        --(iterp->depth);
+    }
+    return false;
+}
+
+bool trie_visit(struct sTrie* triep, TrieVisitor_t visitor, void* ctxp) {
+    TrieIter_t iter;
+    uint16_t value;
+    uint64_t count;
+    trie_iter_init(triep, &iter);
+    while(trie_iter_next(&iter, &value, &count)) {
+        if(!visitor(ctxp, value, count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Insert a non-zero value into the subtrie rooted at nodep, which sits at depth */
+static void trie__insert_value_at(struct sTrie* triep, Node_t* nodep, uint8_t depth, uint16_t value) {
+    uint8_t current_depth = depth;
+    Node_t* current_node = nodep;
+    while(trie__determine_node_type(current_node,current_depth) == NODE_TYPE_TRAVEL) {
+        if(triep->config.counted) {
+            trie__link_total_add(triep, (TravelNode_t*)current_node, IDX_FROM_VALUE(value,current_depth), 1);
+        }
+        current_node = trie__follow_travel_node(triep,
+                                                (TravelNode_t*)current_node, 
+                                                current_depth++, 
+                                                value);
+    }
+    TRIE_STAT_ADD(triep, descents, 1);
+    TRIE_STAT_ADD(triep, descent_depth_total, current_depth);
+    NodeType_t type = trie__determine_node_type(current_node,current_depth);
+    if (type == NODE_TYPE_COUNT) {
+        /* Simply increment the bucket count and exit. At 64 bits it is not going to wrap */
+        ++(*trie__get_count_node_bucket(current_node, value));
+        return;
+    } else if (type == NODE_TYPE_PACKED) {
+        uint16_t* counterp = trie__packed_node_counter(&current_node->packed, value);
+        if(*counterp < UINT16_MAX) {
+            ++(*counterp);
+            return;
+        }
+        /* Out of room, carry on below it as a travel node */
+        trie__promote_packed_node(triep, current_node, value);
+        trie__insert_value_at(triep, current_node, current_depth, value);
+    } else {
+        /* We must be NODE_TYPE_DATA */
+        assert(trie__determine_node_type(current_node,current_depth) == NODE_TYPE_DATA);
+        trie__data_node_insert((DataNode_t*)current_node, value);
+        if(trie__data_node_is_full((DataNode_t*)current_node)) {
+            /* Burst the node here */
+            trie__burst_data_node(triep, (DataNode_t*)current_node, current_depth);
+        }
+    }
+}
+
+/* Insert n copies of a non-zero value into the subtrie rooted at nodep */
+static void trie__insert_value_n_at(struct sTrie* triep, Node_t* nodep, uint8_t depth, uint16_t value, uint64_t n) {
+    uint8_t current_depth = depth;
+    Node_t* current_node = nodep;
+    while(n > 0) {
+        while(trie__determine_node_type(current_node,current_depth) == NODE_TYPE_TRAVEL) {
+            if(triep->config.counted) {
+                trie__link_total_add(triep, (TravelNode_t*)current_node, IDX_FROM_VALUE(value,current_depth), n);
+            }
+            current_node = trie__follow_travel_node(triep,
+                                                    (TravelNode_t*)current_node, 
+                                                    current_depth++, 
+                                                    value);
+        }
+        TRIE_STAT_ADD(triep, descents, 1);
+        TRIE_STAT_ADD(triep, descent_depth_total, current_depth);
+        NodeType_t type = trie__determine_node_type(current_node,current_depth);
+        if (type == NODE_TYPE_COUNT) {
+            *trie__get_count_node_bucket(current_node, value) += n;
+            return;
+        }
+        if (type == NODE_TYPE_PACKED) {
+            uint16_t* counterp = trie__packed_node_counter(&current_node->packed, value);
+            if(n <= UINT16_MAX - *counterp) {
+                *counterp += n;
+                return;
+            }
+            trie__promote_packed_node(triep, current_node, value);
+            continue;
+        }
+        uint8_t free_slots = trie__data_node_free_slots((DataNode_t*)current_node);
+        if(n < free_slots) {
+            trie__data_node_insert_n((DataNode_t*)current_node, value, n);
+            return;
+        }
+        /* Fill the node up and burst it. The copies that did not fit head further down
+         * the same path, with at most one burst per level before they reach a count node */
+        trie__data_node_insert_n((DataNode_t*)current_node, value, free_slots);
+        trie__burst_data_node(triep, (DataNode_t*)current_node, current_depth);
+        n -= free_slots;
+    }
+}
+
+/* Insert a data node's worth of values, one run of duplicates at a time */
+static uint64_t trie__insert_data_node_at(struct sTrie* triep, Node_t* nodep, uint8_t depth, const DataNode_t* valuesp) {
+    uint64_t total = 0;
+    uint8_t i = 0;
+    while(i < NELEMS(valuesp->data) && valuesp->data[31-i] != 0) {
+        uint8_t run = 1;
+        while(i + run < NELEMS(valuesp->data) && valuesp->data[31-i-run] == valuesp->data[31-i]) {
+            ++run;
+        }
+        trie__insert_value_n_at(triep, nodep, depth, valuesp->data[31-i], run);
+        total += run;
+        i += run;
+    }
+    return total;
+}
+
+void trie_insert_value_n(struct sTrie* trie_ctxp, uint16_t value, uint64_t n) {
+    assert(!trie_ctxp->read_only);
+    if (value == 0) {
+        trie_ctxp->number_of_zeros += n;
+        return;
+    }
+    if(trie_ctxp->direct != NULL) {
+        uint8_t levels = trie_ctxp->config.direct_levels;
+        size_t idx = trie__direct_index(trie_ctxp, value);
+        if(trie_ctxp->config.counted) {
+            trie__direct_path_add(trie_ctxp, idx, value, n);
+        }
+        trie__insert_value_n_at(trie_ctxp, trie_ctxp->direct[idx], levels, value, n);
+        return;
+    }
+    trie__insert_value_n_at(trie_ctxp, trie_ctxp->base_node, 0, value, n);
+}
+
+void trie_insert_value(struct sTrie* trie_ctxp, uint16_t value) {
+    assert(!trie_ctxp->read_only);
+    if (value == 0) {
+        ++(trie_ctxp->number_of_zeros);
+        return;
+    }
+    if(trie_ctxp->config.hot_values && trie__hot_insert(trie_ctxp, value)) {
+        return;
+    }
+    if(trie_ctxp->direct != NULL) {
+        /* The direct levels are travel nodes for good, so only their totals need upkeep */
+        uint8_t levels = trie_ctxp->config.direct_levels;
+        size_t idx = trie__direct_index(trie_ctxp, value);
+        if(trie_ctxp->config.counted) {
+            trie__direct_path_add(trie_ctxp, idx, value, 1);
+        }
+        trie__insert_value_at(trie_ctxp, trie_ctxp->direct[idx], levels, value);
+        return;
+    }
+    trie__insert_value_at(trie_ctxp, trie_ctxp->base_node, 0, value);
+}
+
+/* Take n copies of a non-zero value out of a data node that holds at least n of them.
+ * The larger values slide up to close the gap */
+static void trie__data_node_remove_n(DataNode_t* nodep, uint16_t value, uint8_t n) {
+    uint8_t first_used = trie__data_node_free_slots(nodep);
+    /* The copies sit right in front of the first smaller element */
+    uint8_t end = NELEMS(nodep->data);
+    while(end > first_used && nodep->data[end-1] < value) {
+        --end;
+    }
+    assert(end - first_used >= n && nodep->data[end-n] == value);
+    memmove(&nodep->data[first_used + n], &nodep->data[first_used], (end - n - first_used) * sizeof(nodep->data[0]));
+    bzero(&nodep->data[first_used], n * sizeof(nodep->data[0]));
+}
+
+/* Append count copies of value to the data node being collected in collectedp, whose
+ * slots fill up from data[31]. Returns false once they would not leave data[0] free */
+static bool trie__collect_values(DataNode_t* collectedp, uint8_t* usedp, uint16_t value, uint64_t count) {
+    if(count > NELEMS(collectedp->data) - 1 - *usedp) {
+        return false;
+    }
+    for(; count > 0; count--) {
+        collectedp->data[31 - (*usedp)++] = value;
+    }
+    return true;
+}
+
+/* A packed node that is down to a data node's worth of values becomes one */
+static void trie__collapse_packed_node(struct sTrie* triep, Node_t* nodep, uint16_t value) {
+    DataNode_t collected;
+    uint8_t used = 0;
+    uint16_t first_value = value & ~(uint16_t)(NELEMS(nodep->packed.count) - 1);
+    bzero(&collected, sizeof(collected));
+    for(uint8_t i = 0; i < NELEMS(nodep->packed.count); i++) {
+        if(!trie__collect_values(&collected, &used, first_value + i, nodep->packed.count[i])) {
+            return;
+        }
+    }
+    nodep->data = collected;
+    TRIE_STAT_ADD(triep, collapses, 1);
+}
+
+/* A travel node whose subnodes are all data or count nodes, with few enough values
+ * between them, becomes a single data node again. Its slab goes on the free list */
+static void trie__collapse_travel_node(struct sTrie* triep, Node_t* nodep, uint8_t depth, uint16_t value) {
+    DataNode_t collected;
+    uint8_t used = 0;
+    uint16_t first_value = value & ~(uint16_t)(TRIE_SPAN_AT_DEPTH(depth) - 1);
+    bzero(&collected, sizeof(collected));
+    for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+        Node_t* childp = trie__travel_link(triep, &nodep->travel, depth, i);
+        uint16_t child_value = first_value + ((uint16_t)i << GEN_SHIFT(depth));
+        if(depth == TRIE_MAX_DEPTH - 1) {
+            for(uint8_t b = 0; b < TRIE_COUNT_NODE_BUCKETS; b++) {
+                if(!trie__collect_values(&collected, &used, child_value + b, *trie__get_count_node_bucket(childp, child_value + b))) {
+                    return;
+                }
+            }
+            continue;
+        }
+        if(trie__determine_node_type(childp, depth+1) != NODE_TYPE_DATA) {
+            return;
+        }
+        uint8_t child_used = NELEMS(childp->data.data) - trie__data_node_free_slots(&childp->data);
+        if(child_used > NELEMS(collected.data) - 1 - used) {
+            return;
+        }
+        memcpy(&collected.data[32 - used - child_used], &childp->data.data[32 - child_used], child_used * sizeof(collected.data[0]));
+        used += child_used;
+    }
+    TrieSlab_t slab = { .nodes = trie__travel_link(triep, &nodep->travel, depth, 0) };
+    if(triep->config.compact_links) {
+        slab.index = nodep->compact.slab >> 1;
+    }
+    trie__free_slab(triep, slab, depth);
+    nodep->data = collected;
+    TRIE_STAT_ADD(triep, collapses, 1);
+}
+
+/* Remove n copies of a non-zero value from the subtrie at nodep, which holds at least
+ * n of them. The nodes on the way back up collapse if they can */
+static void trie__remove_value_n_at(struct sTrie* triep, Node_t* nodep, uint8_t depth, uint16_t value, uint64_t n) {
+    switch(trie__determine_node_type(nodep, depth)) {
+    case NODE_TYPE_COUNT:
+        *trie__get_count_node_bucket(nodep, value) -= n;
+        break;
+    case NODE_TYPE_PACKED:
+        *trie__packed_node_counter(&nodep->packed, value) -= n;
+        trie__collapse_packed_node(triep, nodep, value);
+        break;
+    case NODE_TYPE_DATA:
+        trie__data_node_remove_n(&nodep->data, value, n);
+        break;
+    case NODE_TYPE_TRAVEL: {
+        Node_t* childp = trie__follow_travel_node(triep, &nodep->travel, depth, value);
+        if(triep->config.counted) {
+            trie__link_total_sub(triep, &nodep->travel, IDX_FROM_VALUE(value,depth), n);
+        }
+        trie__remove_value_n_at(triep, childp, depth+1, value, n);
+        /* Nothing to collapse while the subnode on the way is still a travel node */
+        NodeType_t child_type = trie__determine_node_type(childp, depth+1);
+        if(child_type == NODE_TYPE_DATA || child_type == NODE_TYPE_COUNT) {
+            trie__collapse_travel_node(triep, nodep, depth, value);
+        }
+        break;
+    }
+    default:
+        assert(!"Unexpected NODE_TYPE");
+    }
+}
+
+uint64_t trie_remove_value_n(struct sTrie* trie_ctxp, uint16_t value, uint64_t n) {
+    assert(!trie_ctxp->read_only);
+    uint64_t present = trie_count(trie_ctxp, value);
+    n = (n < present) ? n : present;
+    if(n == 0) {
+        return 0;
+    }
+    if(value == 0) {
+        trie_ctxp->number_of_zeros -= n;
+        return n;
+    }
+    if(trie_ctxp->direct != NULL) {
+        /* The direct levels never collapse, the table points right below them */
+        uint8_t levels = trie_ctxp->config.direct_levels;
+        size_t idx = trie__direct_index(trie_ctxp, value);
+        for(uint8_t i = 0; trie_ctxp->config.counted && i < levels; i++) {
+            trie__link_total_sub(trie_ctxp, &trie_ctxp->direct_path[idx * levels + i]->travel, IDX_FROM_VALUE(value,i), n);
+        }
+        trie__remove_value_n_at(trie_ctxp, trie_ctxp->direct[idx], levels, value, n);
+        return n;
+    }
+    trie__remove_value_n_at(trie_ctxp, trie_ctxp->base_node, 0, value, n);
+    return n;
+}
+
+bool trie_remove_value(struct sTrie* trie_ctxp, uint16_t value) {
+    return trie_remove_value_n(trie_ctxp, value, 1) == 1;
+}
+
+void trie_subtract(struct sTrie* dst_triep, struct sTrie* src_triep) {
+    assert(!dst_triep->read_only);
+    TrieIter_t iter;
+    uint16_t value;
+    uint64_t count;
+    assert(dst_triep != src_triep);
+    trie_iter_init(src_triep, &iter);
+    while(trie_iter_next(&iter, &value, &count)) {
+        trie_remove_value_n(dst_triep, value, count);
+    }
+}
+
+/* Prefetch the next levels nodes on the way from nodep down to value. Only the last
+ * one is fetched without waiting, the ones above it are read so they had better be
+ * in cache already */
+static void trie__prefetch_descent(struct sTrie* triep, Node_t* nodep, uint8_t depth, uint16_t value, uint8_t levels) {
+    while(levels-- > 0 && trie__determine_node_type(nodep,depth) == NODE_TYPE_TRAVEL) {
+        nodep = trie__follow_travel_node(triep, &nodep->travel, depth++, value);
+        __builtin_prefetch(nodep, 1);
+    }
+}
+
+/* Insert n non-zero values into the subtrie rooted at nodep, in order */
+static void trie__insert_values_prefetched(struct sTrie* triep, Node_t* nodep, uint8_t depth, const uint16_t* values, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        /* Fetch the first level below the subtrie root well ahead, then the level below
+         * that once the first one should have arrived */
+        if(i + 2*TRIE_BATCH_PREFETCH_DISTANCE < n) {
+            trie__prefetch_descent(triep, nodep, depth, values[i + 2*TRIE_BATCH_PREFETCH_DISTANCE], 1);
+        }
+        if(i + TRIE_BATCH_PREFETCH_DISTANCE < n) {
+            trie__prefetch_descent(triep, nodep, depth, values[i + TRIE_BATCH_PREFETCH_DISTANCE], 2);
+        }
+        trie__insert_value_at(triep, nodep, depth, values[i]);
+    }
+}
+
+/* One value on its way down in trie__insert_values_interleaved */
+typedef struct {
+    Node_t* node;
+    uint16_t value;
+    uint8_t depth;
+} TrieInsertCursor_t;
+
+/* Insert n non-zero values into the subtrie rooted at nodep. Up to TRIE_BATCH_INTERLEAVE
+ * of them are walked down at once, one level per round, and every step prefetches the
+ * node the cursor moves to. The load then has a whole round of other cursors to hide
+ * behind instead of stalling the walk. A burst only ever turns a data node into a travel
+ * node in place, so a cursor sitting on a node that bursts under it simply carries on
+ * through it next round. */
+static void trie__insert_values_interleaved(struct sTrie* triep, Node_t* nodep, uint8_t depth, const uint16_t* values, size_t n) {
+    TrieInsertCursor_t cursors[TRIE_BATCH_INTERLEAVE];
+    uint8_t active = 0;
+    size_t next = 0;
+    while(active < NELEMS(cursors) && next < n) {
+        cursors[active++] = (TrieInsertCursor_t){ .node = nodep, .value = values[next++], .depth = depth };
+    }
+    while(active > 0) {
+        uint8_t c = 0;
+        while(c < active) {
+            TrieInsertCursor_t* cursorp = &cursors[c];
+            if(trie__determine_node_type(cursorp->node,cursorp->depth) == NODE_TYPE_TRAVEL) {
+                if(triep->config.counted) {
+                    trie__link_total_add(triep, &cursorp->node->travel, IDX_FROM_VALUE(cursorp->value,cursorp->depth), 1);
+                }
+                cursorp->node = trie__follow_travel_node(triep, &cursorp->node->travel, cursorp->depth++, cursorp->value);
+                __builtin_prefetch(cursorp->node, 1);
+                ++c;
+                continue;
+            }
+            /* Arrived, the node is already in cache so finish the insert right away */
+            trie__insert_value_at(triep, cursorp->node, cursorp->depth, cursorp->value);
+            if(next < n) {
+                *cursorp = (TrieInsertCursor_t){ .node = nodep, .value = values[next++], .depth = depth };
+                ++c;
+            } else {
+                /* Fill the hole with the last cursor, which still has to take its step */
+                *cursorp = cursors[--active];
+            }
+        }
+    }
+}
+
+void trie_insert_values(struct sTrie* trie_ctxp, const uint16_t* values, size_t n) {
+    assert(!trie_ctxp->read_only);
+    /* The input is partitioned block by block on the top level index, so all the values
+     * headed into one subtrie are inserted back to back and the walk can start below the
+     * base node. The scratch block is small enough to stay in L1. */
+    uint16_t partitioned[TRIE_BATCH_BLOCK_SIZE];
+    /* The values of a block that the hot value table did not take */
+    uint16_t missed[TRIE_BATCH_BLOCK_SIZE];
+    size_t group_start[NELEMS(((TravelNode_t*)0)->link) + 1];
+
+    while(n > 0) {
+        size_t block_size = n < NELEMS(partitioned) ? n : NELEMS(partitioned);
+        size_t group_fill[NELEMS(((TravelNode_t*)0)->link)] = {0};
+        const uint16_t* blockp = values;
+        values += block_size;
+        n -= block_size;
+        if(trie_ctxp->config.hot_values) {
+            size_t misses = 0;
+            for(size_t i = 0; i < block_size; i++) {
+                if(blockp[i] == 0 || !trie__hot_insert(trie_ctxp, blockp[i])) {
+                    missed[misses++] = blockp[i];
+                }
+            }
+            blockp = missed;
+            block_size = misses;
+        }
+
+        /* Counting sort pass: size each group and pull out the zeros */
+        for(size_t i = 0; i < block_size; i++) {
+            if(blockp[i] == 0) {
+                ++(trie_ctxp->number_of_zeros);
+            } else {
+                ++group_fill[IDX_FROM_VALUE(blockp[i],0)];
+            }
+        }
+        group_start[0] = 0;
+        for(uint8_t g = 0; g < NELEMS(group_fill); g++) {
+            group_start[g+1] = group_start[g] + group_fill[g];
+            group_fill[g] = group_start[g];
+        }
+        for(size_t i = 0; i < block_size; i++) {
+            if(blockp[i] != 0) {
+                partitioned[group_fill[IDX_FROM_VALUE(blockp[i],0)]++] = blockp[i];
+            }
+        }
+
+        for(uint8_t g = 0; g < NELEMS(group_fill); g++) {
+            size_t i = group_start[g];
+            /* Until the base node bursts every value has to start at the top */
+            for(; i < group_start[g+1] && trie__determine_node_type(trie_ctxp->base_node,0) == NODE_TYPE_DATA; i++) {
+                trie__insert_value_at(trie_ctxp, trie_ctxp->base_node, 0, partitioned[i]);
+            }
+            if(i < group_start[g+1]) {
+                /* Only removals turn a travel node back into a data node, so within
+                 * one batch the subtrie root for this group stays valid for the rest
+                 * of the group */
+                Node_t* subtriep = trie__follow_travel_node(trie_ctxp, &trie_ctxp->base_node->travel, 0, partitioned[i]);
+                if(trie_ctxp->config.counted) {
+                    trie__link_total_add(trie_ctxp, &trie_ctxp->base_node->travel, g, group_start[g+1] - i);
+                }
+                if(trie_ctxp->config.interleaved) {
+                    trie__insert_values_interleaved(trie_ctxp, subtriep, 1, &partitioned[i], group_start[g+1] - i);
+                } else {
+                    trie__insert_values_prefetched(trie_ctxp, subtriep, 1, &partitioned[i], group_start[g+1] - i);
+                }
+            }
+        }
+    }
+}
+
+uint64_t trie_count(struct sTrie* triep, uint16_t value) {
+    trie__hot_flush(triep);
+    if (value == 0) {
+        return triep->number_of_zeros;
+    }
+    TrieReader_t reader = trie__reader(triep);
+    return trie__count_subtrie_value(&reader, triep->base_node, value);
+}
+
+uint64_t trie_count_range(struct sTrie* triep, uint16_t lo, uint16_t hi) {
+    if (lo > hi) {
+        return 0;
+    }
+    trie__hot_flush(triep);
+    TrieReader_t reader = trie__reader(triep);
+    uint64_t count = (lo == 0) ? triep->number_of_zeros : 0;
+    return count + trie__count_subtrie_range(&reader, triep->base_node, 0, 0, lo, hi);
+}
+
+uint64_t trie_rank(struct sTrie* triep, uint16_t value) {
+    return (value == 0) ? 0 : trie_count_range(triep, 0, value-1);
+}
+
+uint16_t trie_quantile(struct sTrie* triep, double q) {
+    trie__hot_flush(triep);
+    TrieReader_t reader = trie__reader(triep);
+    return trie__quantile(&reader, triep->base_node, triep->number_of_zeros, q);
+}
+
+void trie_insert_value_concurrent(struct sTrie* trie_ctxp, uint16_t value) {
+    assert(trie_ctxp->config.concurrent && !trie_ctxp->read_only);
+    if (value == 0) {
+        __atomic_fetch_add(&trie_ctxp->number_of_zeros, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint8_t current_depth = 0;
+    Node_t* current_node = trie_ctxp->base_node;
+    uint32_t spins = 0;
+    if(trie_ctxp->direct != NULL) {
+        size_t idx = trie__direct_index(trie_ctxp, value);
+        current_depth = trie_ctxp->config.direct_levels;
+        for(uint8_t i = 0; trie_ctxp->config.counted && i < current_depth; i++) {
+            __atomic_fetch_add(&trie__travel_node_counts(&trie_ctxp->direct_path[idx * current_depth + i]->travel)[IDX_FROM_VALUE(value,i)], 1, __ATOMIC_RELAXED);
+        }
+        current_node = trie_ctxp->direct[idx];
+    }
+    for(;;) {
+        if(current_depth == TRIE_MAX_DEPTH) {
+            /* Count nodes never change type, so the bucket just needs an atomic add */
+            TRIE_STAT_ADD(trie_ctxp, descents, 1);
+            TRIE_STAT_ADD(trie_ctxp, descent_depth_total, current_depth);
+            __atomic_fetch_add(trie__get_count_node_bucket(current_node, value), 1, __ATOMIC_RELAXED);
+            return;
+        }
+        /* The type and lock live in the low bits of the first word, which is always
+         * accessed atomically as a whole */
+        Node_t* head = __atomic_load_n(&current_node->travel.link[0], __ATOMIC_ACQUIRE);
+        if((uintptr_t)head & 0x1) {
+            /* Travel node, the acquire load above made its subnodes visible */
+            if(trie_ctxp->config.counted) {
+                __atomic_fetch_add(&trie__travel_node_counts(&current_node->travel)[IDX_FROM_VALUE(value,current_depth)], 1, __ATOMIC_RELAXED);
+            }
+            current_node = trie__follow_travel_node(trie_ctxp, &current_node->travel, current_depth++, value);
+            continue;
+        }
+        if(((uintptr_t)head & 0xFFFF) != 0 ||
+           !__atomic_compare_exchange_n(&current_node->travel.link[0], &head, (Node_t*)((uintptr_t)head | TRIE_DATA_NODE_LOCKED),
+                                        false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            /* Somebody else is inserting here or bursting this node, look again once they are done */
+            trie__cpu_relax(&spins);
+            continue;
+        }
+        /* We own the data node. Work on a copy so the lock marker stays in place. The
+         * first word is what the exchange above saw, everything past it is private to
+         * the lock holder */
+        const size_t head_size = sizeof(head);
+        Node_t node_copy;
+        node_copy.travel.link[0] = head;
+        memcpy((uint8_t*)&node_copy + head_size, (uint8_t*)current_node + head_size, sizeof(node_copy) - head_size);
+        TRIE_STAT_ADD(trie_ctxp, descents, 1);
+        TRIE_STAT_ADD(trie_ctxp, descent_depth_total, current_depth);
+        trie__data_node_insert(&node_copy.data, value);
+        if(trie__data_node_is_full(&node_copy.data)) {
+            /* Publishing the links releases the lock */
+            trie__burst_data_node_into(trie_ctxp, &node_copy.data, &current_node->travel, current_depth);
+        } else {
+            /* The first word goes back last with data[0] cleared, which releases the lock */
+            memcpy((uint8_t*)current_node + head_size, (uint8_t*)&node_copy + head_size, sizeof(node_copy) - head_size);
+            __atomic_store_n(&current_node->travel.link[0], node_copy.travel.link[0], __ATOMIC_RELEASE);
+        }
+        return;
+    }
+}
+
+/* Copy the subtrie at srcp into dstp, which must be free to overwrite. Returns the
+ * number of values copied so a counted parent can record it */
+static uint64_t trie__copy_subtrie(struct sTrie* dst_triep, Node_t* dstp, struct sTrie* src_triep, Node_t* srcp, uint16_t value, uint8_t depth) {
+    uint64_t total = 0;
+    switch(trie__determine_node_type(srcp, depth)) {
+    case NODE_TYPE_COUNT:
+        for(uint8_t i = 0; i < TRIE_COUNT_NODE_BUCKETS; i++) {
+            *trie__get_count_node_bucket(dstp, value+i) = *trie__get_count_node_bucket(srcp, value+i);
+            total += *trie__get_count_node_bucket(srcp, value+i);
+        }
+        break;
+    case NODE_TYPE_PACKED:
+        dstp->packed = srcp->packed;
+        for(uint8_t i = 0; i < NELEMS(srcp->packed.count); i++) {
+            total += srcp->packed.count[i];
+        }
+        if(!dst_triep->config.compact_counts) {
+            trie__promote_packed_node(dst_triep, dstp, value);
+        }
+        break;
+    case NODE_TYPE_DATA:
+        dstp->data = srcp->data;
+        for(uint8_t i = 0; i < NELEMS(srcp->data.data); i++) {
+            total += (srcp->data.data[i] != 0);
+        }
+        break;
+    case NODE_TYPE_TRAVEL: {
+        uint64_t totals[NELEMS(srcp->travel.link)];
+        TrieSlab_t slab = trie__alloc_slab(dst_triep, value, depth);
+        for(uint8_t i = 0; i < NELEMS(srcp->travel.link); i++) {
+            totals[i] = trie__copy_subtrie(dst_triep, trie__slab_child(slab.nodes, depth, i), src_triep, trie__travel_link(src_triep, &srcp->travel, depth, i), value + ((uint16_t)i << GEN_SHIFT(depth)), depth+1);
+            total += totals[i];
+        }
+        trie__write_travel_node(dst_triep, &dstp->travel, slab, depth, totals);
+        break;
+    }
+    default:
+        assert(!"Unexpected NODE_TYPE");
+    }
+    return total;
+}
+
+/* Add everything in the src subtrie into the dst subtrie that covers the same values.
+ * Returns the number of values added */
+static uint64_t trie__merge_subtrie(struct sTrie* dst_triep, Node_t* dstp, struct sTrie* src_triep, Node_t* srcp, uint16_t value, uint8_t depth) {
+    uint64_t total = 0;
+    switch(trie__determine_node_type(srcp, depth)) {
+    case NODE_TYPE_COUNT:
+        /* Both sides are count nodes at this depth, add the buckets */
+        for(uint8_t i = 0; i < TRIE_COUNT_NODE_BUCKETS; i++) {
+            *trie__get_count_node_bucket(dstp, value+i) += *trie__get_count_node_bucket(srcp, value+i);
+            total += *trie__get_count_node_bucket(srcp, value+i);
+        }
+        break;
+    case NODE_TYPE_DATA:
+        total = trie__insert_data_node_at(dst_triep, dstp, depth, &srcp->data);
+        break;
+    case NODE_TYPE_PACKED:
+        /* Whatever dst has here, inserting the counts handles it */
+        for(uint8_t i = 0; i < NELEMS(srcp->packed.count); i++) {
+            if(srcp->packed.count[i] != 0) {
+                trie__insert_value_n_at(dst_triep, dstp, depth, value + i, srcp->packed.count[i]);
+                total += srcp->packed.count[i];
+            }
+        }
+        break;
+    case NODE_TYPE_TRAVEL:
+        if(trie__determine_node_type(dstp, depth) == NODE_TYPE_PACKED) {
+            trie__promote_packed_node(dst_triep, dstp, value);
+        }
+        if(trie__determine_node_type(dstp, depth) == NODE_TYPE_TRAVEL) {
+            for(uint8_t i = 0; i < NELEMS(srcp->travel.link); i++) {
+                uint64_t child_total = trie__merge_subtrie(dst_triep, trie__travel_link(dst_triep, &dstp->travel, depth, i),
+                                                           src_triep, trie__travel_link(src_triep, &srcp->travel, depth, i),
+                                                           value + ((uint16_t)i << GEN_SHIFT(depth)), depth+1);
+                if(dst_triep->config.counted) {
+                    trie__link_total_add(dst_triep, &dstp->travel, i, child_total);
+                }
+                total += child_total;
+            }
+        } else {
+            /* Take over the structure of the src subtrie and put the few values the
+             * dst data node held back into it */
+            DataNode_t saved = dstp->data;
+            total = trie__copy_subtrie(dst_triep, dstp, src_triep, srcp, value, depth);
+            /* Only the values from src count as added */
+            trie__insert_data_node_at(dst_triep, dstp, depth, &saved);
+        }
+        break;
+    default:
+        assert(!"Unexpected NODE_TYPE");
+    }
+    return total;
+}
+
+void trie_merge_into(struct sTrie* dst_triep, struct sTrie* src_triep) {
+    assert(dst_triep != src_triep && !dst_triep->read_only);
+    trie__hot_flush(src_triep);
+    dst_triep->number_of_zeros += src_triep->number_of_zeros;
+    trie__merge_subtrie(dst_triep, dst_triep->base_node, src_triep, src_triep->base_node, 0, 0);
+}
+
+/* Set algebra
+ * The operands are walked side by side. Where every one of them has a travel node the
+ * walk goes link by link and skips the subtries an operand has nothing in, which is
+ * known from the link totals of a counted trie or from a data node not having any
+ * values. Below that the subtries are merged value by value with iterators over them */
+
+/* At least the number of values below link idx, exact for counted tries. 0 only if
+ * there are none */
+static uint64_t trie__link_bound(struct sTrie* triep, TravelNode_t* nodep, uint8_t depth, uint8_t idx) {
+    if(triep->config.counted) {
+        TrieReader_t reader = trie__reader(triep);
+        return trie__reader_total(&reader, nodep, idx);
+    }
+    Node_t* childp = trie__travel_link(triep, nodep, depth, idx);
+    switch(trie__determine_node_type(childp, depth+1)) {
+    case NODE_TYPE_DATA:
+        return NELEMS(childp->data.data) - trie__data_node_free_slots(&childp->data);
+    case NODE_TYPE_COUNT: {
+        uint16_t value = (uint16_t)idx << GEN_SHIFT(depth);
+        return *trie__get_count_node_bucket(childp, value) + *trie__get_count_node_bucket(childp, value+1);
+    }
+    default:
+        return UINT64_MAX;
+    }
+}
+
+static uint64_t trie__intersect_subtrie(struct sTrie* a_triep, Node_t* ap, struct sTrie* b_triep, Node_t* bp, uint16_t value, uint8_t depth) {
+    uint64_t total = 0;
+    if(trie__determine_node_type(ap, depth) == NODE_TYPE_TRAVEL && trie__determine_node_type(bp, depth) == NODE_TYPE_TRAVEL) {
+        for(uint8_t i = 0; i < NELEMS(ap->travel.link); i++) {
+            if(trie__link_bound(a_triep, &ap->travel, depth, i) == 0 || trie__link_bound(b_triep, &bp->travel, depth, i) == 0) {
+                continue;
+            }
+            total += trie__intersect_subtrie(a_triep, trie__travel_link(a_triep, &ap->travel, depth, i),
+                                             b_triep, trie__travel_link(b_triep, &bp->travel, depth, i),
+                                             value + ((uint16_t)i << GEN_SHIFT(depth)), depth+1);
+        }
+        return total;
+    }
+    TrieIter_t a_iter, b_iter;
+    uint16_t a_value, b_value;
+    uint64_t a_count, b_count;
+    trie__iter_init_at(&a_iter, a_triep, ap, value, depth);
+    trie__iter_init_at(&b_iter, b_triep, bp, value, depth);
+    bool a_more = trie_iter_next(&a_iter, &a_value, &a_count);
+    bool b_more = trie_iter_next(&b_iter, &b_value, &b_count);
+    while(a_more && b_more) {
+        if(a_value < b_value) {
+            a_more = trie_iter_next(&a_iter, &a_value, &a_count);
+        } else if(b_value < a_value) {
+            b_more = trie_iter_next(&b_iter, &b_value, &b_count);
+        } else {
+            total += (a_count < b_count) ? a_count : b_count;
+            a_more = trie_iter_next(&a_iter, &a_value, &a_count);
+            b_more = trie_iter_next(&b_iter, &b_value, &b_count);
+        }
+    }
+    return total;
+}
+
+uint64_t trie_intersect_count(struct sTrie* a_triep, struct sTrie* b_triep) {
+    trie__hot_flush(a_triep);
+    trie__hot_flush(b_triep);
+    uint64_t zeros = (a_triep->number_of_zeros < b_triep->number_of_zeros) ? a_triep->number_of_zeros : b_triep->number_of_zeros;
+    return zeros + trie__intersect_subtrie(a_triep, a_triep->base_node, b_triep, b_triep->base_node, 0, 0);
+}
+
+struct sTrie* trie_union(struct sTrie* const* triepp, size_t n, const struct sTrieConfig* configp) {
+    struct sTrie* triep = trie_init_ex(configp);
+    for(size_t i = 0; triep != NULL && i < n; i++) {
+        trie_merge_into(triep, triepp[i]);
+    }
+    return triep;
+}
+
+typedef struct {
+    uint16_t value;
+    uint64_t count;
+} TrieTopEntry_t;
+
+/* The candidates so far sit in a heap with the weakest one on top */
+typedef struct {
+    struct sTrie* const* tries;
+    size_t trie_count;
+    /* The nodes of every trie at each depth of the walk, NULL where a trie has no
+     * values */
+    Node_t** nodes;
+    /* The iterators of a merge, with the next value of each and its count, or 0 once
+     * the iterator is done */
+    TrieIter_t* iters;
+    uint16_t* heads;
+    uint64_t* counts;
+    TrieTopEntry_t* heap;
+    size_t size;
+    size_t k;
+} TrieTopK_t;
+
+/* True if a ranks below b: fewer values, or as many and a larger value */
+static bool trie__top_weaker(uint64_t a_count, uint16_t a_value, uint64_t b_count, uint16_t b_value) {
+    return a_count < b_count || (a_count == b_count && a_value > b_value);
+}
+
+/* Could a value of at least lo seen count times make it into the top k */
+static bool trie__top_k_may_enter(const TrieTopK_t* topp, uint64_t count, uint16_t lo) {
+    return topp->size < topp->k || trie__top_weaker(topp->heap[0].count, topp->heap[0].value, count, lo);
+}
+
+static void trie__top_k_sift_down(TrieTopK_t* topp, size_t i) {
+    for(;;) {
+        size_t weakest = i;
+        for(size_t child = 2*i + 1; child <= 2*i + 2 && child < topp->size; child++) {
+            if(trie__top_weaker(topp->heap[child].count, topp->heap[child].value, topp->heap[weakest].count, topp->heap[weakest].value)) {
+                weakest = child;
+            }
+        }
+        if(weakest == i) {
+            return;
+        }
+        TrieTopEntry_t entry = topp->heap[i];
+        topp->heap[i] = topp->heap[weakest];
+        topp->heap[weakest] = entry;
+        i = weakest;
+    }
+}
+
+static void trie__top_k_offer(TrieTopK_t* topp, uint16_t value, uint64_t count) {
+    if(count == 0 || !trie__top_k_may_enter(topp, count, value)) {
+        return;
+    }
+    if(topp->size == topp->k) {
+        topp->heap[0] = (TrieTopEntry_t){ .value = value, .count = count };
+        trie__top_k_sift_down(topp, 0);
+        return;
+    }
+    /* Sift the new entry up */
+    size_t i = topp->size++;
+    while(i > 0 && trie__top_weaker(count, value, topp->heap[(i-1)/2].count, topp->heap[(i-1)/2].value)) {
+        topp->heap[i] = topp->heap[(i-1)/2];
+        i = (i-1)/2;
+    }
+    topp->heap[i] = (TrieTopEntry_t){ .value = value, .count = count };
+}
+
+/* Offer the sum of every trie's count for each value of the subtries at depth */
+static void trie__top_k_merge(TrieTopK_t* topp, uint16_t value, uint8_t depth) {
+    Node_t** groupp = &topp->nodes[depth * topp->trie_count];
+    uint16_t* heads = topp->heads;
+    uint64_t* counts = topp->counts;
+    for(size_t t = 0; t < topp->trie_count; t++) {
+        counts[t] = 0;
+        if(groupp[t] != NULL) {
+            trie__iter_init_at(&topp->iters[t], topp->tries[t], groupp[t], value, depth);
+            counts[t] = trie_iter_next(&topp->iters[t], &heads[t], &counts[t]) ? counts[t] : 0;
+        }
+    }
+    for(;;) {
+        bool any = false;
+        uint16_t lowest = UINT16_MAX;
+        for(size_t t = 0; t < topp->trie_count; t++) {
+            if(counts[t] != 0 && (!any || heads[t] < lowest)) {
+                lowest = heads[t];
+                any = true;
+            }
+        }
+        if(!any) {
+            break;
+        }
+        uint64_t count = 0;
+        for(size_t t = 0; t < topp->trie_count; t++) {
+            if(counts[t] != 0 && heads[t] == lowest) {
+                count += counts[t];
+                counts[t] = trie_iter_next(&topp->iters[t], &heads[t], &counts[t]) ? counts[t] : 0;
+            }
+        }
+        trie__top_k_offer(topp, lowest, count);
+    }
+}
+
+/* The subtries with the largest link totals go first so the heap fills with strong
+ * candidates early, after which a subtrie whose total can't beat the weakest one is
+ * skipped */
+static void trie__top_k_subtrie(TrieTopK_t* topp, uint16_t value, uint8_t depth) {
+    Node_t** groupp = &topp->nodes[depth * topp->trie_count];
+    for(size_t t = 0; t < topp->trie_count; t++) {
+        if(groupp[t] != NULL && trie__determine_node_type(groupp[t], depth) != NODE_TYPE_TRAVEL) {
+            trie__top_k_merge(topp, value, depth);
+            return;
+        }
+    }
+    uint64_t bounds[NELEMS(((TravelNode_t*)0)->link)];
+    uint8_t order[NELEMS(bounds)];
+    for(uint8_t i = 0; i < NELEMS(bounds); i++) {
+        bounds[i] = 0;
+        for(size_t t = 0; t < topp->trie_count; t++) {
+            uint64_t bound = (groupp[t] != NULL) ? trie__link_bound(topp->tries[t], &groupp[t]->travel, depth, i) : 0;
+            bounds[i] = (bound > UINT64_MAX - bounds[i]) ? UINT64_MAX : bounds[i] + bound;
+        }
+        uint8_t j = i;
+        for(; j > 0 && bounds[order[j-1]] < bounds[i]; j--) {
+            order[j] = order[j-1];
+        }
+        order[j] = i;
+    }
+    Node_t** childrenp = &topp->nodes[(depth+1) * topp->trie_count];
+    for(uint8_t o = 0; o < NELEMS(order); o++) {
+        uint8_t i = order[o];
+        uint16_t child_value = value + ((uint16_t)i << GEN_SHIFT(depth));
+        if(bounds[i] == 0 || !trie__top_k_may_enter(topp, bounds[i], child_value)) {
+            continue;
+        }
+        for(size_t t = 0; t < topp->trie_count; t++) {
+            bool empty = (groupp[t] == NULL || trie__link_bound(topp->tries[t], &groupp[t]->travel, depth, i) == 0);
+            childrenp[t] = empty ? NULL : trie__travel_link(topp->tries[t], &groupp[t]->travel, depth, i);
+        }
+        trie__top_k_subtrie(topp, child_value, depth+1);
+    }
+}
+
+size_t trie_top_k(struct sTrie* const* triepp, size_t n, size_t k, uint16_t* valuesp, uint64_t* countsp) {
+    if(k == 0 || n == 0) {
+        return 0;
+    }
+    /* There aren't more distinct values than that */
+    k = (k < 0x10000) ? k : 0x10000;
+    TrieTopK_t top = { .tries = triepp, .trie_count = n, .k = k };
+    top.nodes = calloc(TRIE_LEVELS * n, sizeof(*top.nodes));
+    top.iters = calloc(n, sizeof(*top.iters));
+    top.heads = calloc(n, sizeof(*top.heads));
+    top.counts = calloc(n, sizeof(*top.counts));
+    top.heap = calloc(k, sizeof(*top.heap));
+    assert(top.nodes != NULL && top.iters != NULL && top.heads != NULL && top.counts != NULL && top.heap != NULL);
+    uint64_t zeros = 0;
+    bool any_counted = false;
+    for(size_t t = 0; t < n; t++) {
+        trie__hot_flush(triepp[t]);
+        zeros += triepp[t]->number_of_zeros;
+        top.nodes[t] = triepp[t]->base_node;
+        any_counted |= triepp[t]->config.counted;
+    }
+    trie__top_k_offer(&top, 0, zeros);
+    if(any_counted) {
+        trie__top_k_subtrie(&top, 0, 0);
+    } else {
+        /* Nothing to prune by, adding every trie up in a table beats merging them */
+        uint64_t* totals = calloc(0x10000, sizeof(*totals));
+        assert(totals != NULL);
+        for(size_t t = 0; t < n; t++) {
+            TrieIter_t iter;
+            uint16_t value;
+            uint64_t count;
+            trie__iter_init_at(&iter, triepp[t], triepp[t]->base_node, 0, 0);
+            while(trie_iter_next(&iter, &value, &count)) {
+                totals[value] += count;
+            }
+        }
+        for(uint32_t value = 1; value <= 0xFFFF; value++) {
+            trie__top_k_offer(&top, value, totals[value]);
+        }
+        free(totals);
+    }
+    /* Taking the weakest off the heap each time fills the result from the back */
+    size_t found = top.size;
+    while(top.size > 0) {
+        valuesp[top.size-1] = top.heap[0].value;
+        countsp[top.size-1] = top.heap[0].count;
+        top.heap[0] = top.heap[--top.size];
+        trie__top_k_sift_down(&top, 0);
+    }
+    free(top.heap);
+    free(top.counts);
+    free(top.heads);
+    free(top.iters);
+    free(top.nodes);
+    return found;
+}
+
+/* Compaction
+ * The trie is copied into a fresh arena whose first chunk is sized for the whole copy.
+ * The copy allocates in depth first order, so a travel node's subtries follow its slab.
+ * Below the direct levels, a travel node whose subtrie holds few enough values is
+ * gathered into a data node instead of copied */
+
+/* Append the values of the subtrie at nodep to the data node being collected. Returns
+ * false once they would not fit */
+static bool trie__gather_subtrie(struct sTrie* triep, Node_t* nodep, uint16_t value, uint8_t depth, DataNode_t* collectedp, uint8_t* usedp) {
+    switch(trie__determine_node_type(nodep, depth)) {
+    case NODE_TYPE_COUNT:
+        for(uint8_t i = 0; i < TRIE_COUNT_NODE_BUCKETS; i++) {
+            if(!trie__collect_values(collectedp, usedp, value + i, *trie__get_count_node_bucket(nodep, value + i))) {
+                return false;
+            }
+        }
+        return true;
+    case NODE_TYPE_PACKED:
+        for(uint8_t i = 0; i < NELEMS(nodep->packed.count); i++) {
+            if(!trie__collect_values(collectedp, usedp, value + i, nodep->packed.count[i])) {
+                return false;
+            }
+        }
+        return true;
+    case NODE_TYPE_DATA: {
+        uint8_t used = NELEMS(nodep->data.data) - trie__data_node_free_slots(&nodep->data);
+        if(used > NELEMS(collectedp->data) - 1 - *usedp) {
+            return false;
+        }
+        memcpy(&collectedp->data[32 - *usedp - used], &nodep->data.data[32 - used], used * sizeof(collectedp->data[0]));
+        *usedp += used;
+        return true;
+    }
+    case NODE_TYPE_TRAVEL:
+        for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+            if(!trie__gather_subtrie(triep, trie__travel_link(triep, &nodep->travel, depth, i),
+                                     value + ((uint16_t)i << GEN_SHIFT(depth)), depth+1, collectedp, usedp)) {
+                return false;
+            }
+        }
+        return true;
+    default:
+        assert(!"Unexpected NODE_TYPE");
+    }
+    return false;
+}
+
+/* True if the compacted copy of a travel node at depth is a data node, filled into
+ * collectedp */
+static bool trie__compact_gathers(struct sTrie* triep, Node_t* nodep, uint16_t value, uint8_t depth, DataNode_t* collectedp, uint8_t* usedp) {
+    *usedp = 0;
+    bzero(collectedp, sizeof(*collectedp));
+    return depth >= triep->config.direct_levels && trie__gather_subtrie(triep, nodep, value, depth, collectedp, usedp);
+}
+
+/* Bytes of slabs the compacted copy of the subtrie at nodep takes */
+static size_t trie__compact_size(struct sTrie* triep, Node_t* nodep, uint16_t value, uint8_t depth) {
+    DataNode_t collected;
+    uint8_t used;
+    if(trie__determine_node_type(nodep, depth) != NODE_TYPE_TRAVEL || trie__compact_gathers(triep, nodep, value, depth, &collected, &used)) {
+        return 0;
+    }
+    size_t size = trie__slab_size(triep, depth);
+    for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+        size += trie__compact_size(triep, trie__travel_link(triep, &nodep->travel, depth, i), value + ((uint16_t)i << GEN_SHIFT(depth)), depth+1);
+    }
+    return size;
+}
+
+/* Like trie__copy_subtrie, but gathers the small subtries. Returns the number of values
+ * copied */
+static uint64_t trie__compact_subtrie(struct sTrie* dst_triep, Node_t* dstp, struct sTrie* src_triep, Node_t* srcp, uint16_t value, uint8_t depth) {
+    if(trie__determine_node_type(srcp, depth) != NODE_TYPE_TRAVEL) {
+        return trie__copy_subtrie(dst_triep, dstp, src_triep, srcp, value, depth);
+    }
+    DataNode_t collected;
+    uint8_t used;
+    if(trie__compact_gathers(src_triep, srcp, value, depth, &collected, &used)) {
+        dstp->data = collected;
+        TRIE_STAT_ADD(dst_triep, collapses, 1);
+        return used;
+    }
+    uint64_t totals[NELEMS(srcp->travel.link)];
+    uint64_t total = 0;
+    TrieSlab_t slab = trie__alloc_slab(dst_triep, value, depth);
+    for(uint8_t i = 0; i < NELEMS(srcp->travel.link); i++) {
+        totals[i] = trie__compact_subtrie(dst_triep, trie__slab_child(slab.nodes, depth, i), src_triep, trie__travel_link(src_triep, &srcp->travel, depth, i), value + ((uint16_t)i << GEN_SHIFT(depth)), depth+1);
+        total += totals[i];
+    }
+    trie__write_travel_node(dst_triep, &dstp->travel, slab, depth, totals);
+    return total;
+}
+
+/* Copy src into dst, whose arenas have to be empty, in one chunk. dst gets a new base
+ * node and keeps its own configuration, which needs the same slab layout as src */
+static void trie__compact_into(struct sTrie* dst_triep, struct sTrie* src_triep) {
+    size_t size = CACHE_LINE_SIZE + trie__compact_size(src_triep, src_triep->base_node, 0, 0);
+    if(dst_triep->config.compact_links && size > TRIE_ARENA_MAX_CHUNK_SIZE - CACHE_LINE_SIZE) {
+        /* Compact links can't reach past a chunk of the maximum size */
+        size = TRIE_ARENA_MAX_CHUNK_SIZE - CACHE_LINE_SIZE;
+    }
+    /* The chunk header takes a cache line too */
+    trie__arena_new_chunk(&dst_triep->arena, size + CACHE_LINE_SIZE);
+
+    /* Vertical tries spread new slabs over the lanes, the copy goes in one block */
+    bool vertical = dst_triep->config.vertical;
+    dst_triep->config.vertical = false;
+    trie__alloc_node(dst_triep, &dst_triep->base_node);
+    trie__compact_subtrie(dst_triep, dst_triep->base_node, src_triep, src_triep->base_node, 0, 0);
+    dst_triep->config.vertical = vertical;
+    dst_triep->number_of_zeros = src_triep->number_of_zeros;
+}
+
+void trie_compact(struct sTrie* triep) {
+    assert(!triep->read_only);
+    trie__hot_flush(triep);
+    /* The old trie stays readable through its own copy of the arenas until the end */
+    struct sTrie* oldp = aligned_alloc(CACHE_LINE_SIZE, sizeof(*oldp));
+    assert(oldp != NULL);
+    *oldp = *triep;
+    bzero(&triep->arena, sizeof(triep->arena));
+    bzero(triep->lanes, sizeof(triep->lanes));
+    bzero(triep->free_slabs, sizeof(triep->free_slabs));
+    triep->free_slab_bytes = 0;
+    triep->chunk_table = NULL;
+    triep->chunk_count = 0;
+    triep->chunk_capacity = 0;
+    trie__compact_into(triep, oldp);
+    if(triep->direct != NULL) {
+        Node_t* pathp[TRIE_DIRECT_LEVELS_MAX] = {0};
+        trie__build_direct_levels(triep, triep->base_node, 0, 0, pathp);
+    }
+
+    trie__arena_free(&oldp->arena);
+    for(uint8_t i = 0; i < NELEMS(oldp->lanes); i++) {
+        trie__arena_free(&oldp->lanes[i]);
+    }
+    free(oldp->chunk_table);
+    free(oldp);
+}
+
+/* Snapshots
+ * A 16 bit trie can't grow past a few thousand travel nodes, so a snapshot is simply a
+ * compacted copy, which leaves the insert path of the source trie alone. The copy walks
+ * the whole trie, about a millisecond or two for one that holds every value */
+struct sTrie* trie_snapshot(struct sTrie* triep) {
+    trie__hot_flush(triep);
+    struct sTrie* snapshotp = aligned_alloc(CACHE_LINE_SIZE, sizeof(*snapshotp));
+    assert(snapshotp != NULL);
+    bzero(snapshotp, sizeof(*snapshotp));
+    /* Only what shapes the nodes carries over, the rest is about inserting */
+    snapshotp->config.counted = triep->config.counted;
+    snapshotp->config.compact_counts = triep->config.compact_counts;
+    snapshotp->config.compact_links = triep->config.compact_links;
+    trie__compact_into(snapshotp, triep);
+    snapshotp->read_only = true;
+    return snapshotp;
+}
+
+/* Serialization
+ * The stream is a small header followed by the nodes in pre-order. Each node starts with
+ * a tag byte: a travel node is followed by its 8 subnodes, a data node by its number of
+ * values and the values as deltas, and a count node by a bitmap of its non-empty buckets
+ * and their counts. All numbers are LEB128 varints. */
+static const char trie_stream_magic[4] = {'B','T','R','S'};
+#define TRIE_STREAM_VERSION ( 1 )
+
+#define TRIE_STREAM_TAG_DATA 'D'
+#define TRIE_STREAM_TAG_TRAVEL 'T'
+#define TRIE_STREAM_TAG_COUNT 'C'
+
+static void trie__write_varint(FILE* fp, uint64_t value) {
+    while(value >= 0x80) {
+        fputc((int)(value & 0x7F) | 0x80, fp);
+        value >>= 7;
+    }
+    fputc((int)value, fp);
+}
+
+static bool trie__read_varint(FILE* fp, uint64_t* valuep) {
+    uint64_t value = 0;
+    for(uint8_t shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(fp);
+        if(byte == EOF) {
+            return false;
+        }
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if((byte & 0x80) == 0) {
+            *valuep = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void trie__serialize_count_node(FILE* fp, const uint64_t* bucketsp) {
+    uint8_t bitmap = 0;
+    for(uint8_t i = 0; i < TRIE_COUNT_NODE_BUCKETS; i++) {
+        bitmap |= (bucketsp[i] != 0) << i;
+    }
+    fputc(TRIE_STREAM_TAG_COUNT, fp);
+    fputc(bitmap, fp);
+    for(uint8_t i = 0; i < TRIE_COUNT_NODE_BUCKETS; i++) {
+        if(bucketsp[i] != 0) {
+            trie__write_varint(fp, bucketsp[i]);
+        }
+    }
+}
+
+static void trie__serialize_subtrie(FILE* fp, struct sTrie* triep, Node_t* nodep, uint8_t depth) {
+    switch(trie__determine_node_type(nodep, depth)) {
+    case NODE_TYPE_COUNT:
+        trie__serialize_count_node(fp, (uint64_t*)nodep);
+        break;
+    case NODE_TYPE_PACKED:
+        /* Written out as the travel node and count nodes it stands in for, so the
+         * stream does not depend on the counter width */
+        fputc(TRIE_STREAM_TAG_TRAVEL, fp);
+        for(uint8_t i = 0; i < NELEMS(nodep->packed.count); i += TRIE_COUNT_NODE_BUCKETS) {
+            uint64_t buckets[TRIE_COUNT_NODE_BUCKETS];
+            for(uint8_t j = 0; j < TRIE_COUNT_NODE_BUCKETS; j++) {
+                buckets[j] = nodep->packed.count[i + j];
+            }
+            trie__serialize_count_node(fp, buckets);
+        }
+        break;
+    case NODE_TYPE_DATA: {
+        uint8_t used = NELEMS(nodep->data.data) - trie__data_node_free_slots(&nodep->data);
+        uint16_t previous = 0;
+        fputc(TRIE_STREAM_TAG_DATA, fp);
+        trie__write_varint(fp, used);
+        for(uint8_t i = 0; i < used; i++) {
+            trie__write_varint(fp, nodep->data.data[31-i] - previous);
+            previous = nodep->data.data[31-i];
+        }
+        break;
+    }
+    case NODE_TYPE_TRAVEL:
+        fputc(TRIE_STREAM_TAG_TRAVEL, fp);
+        for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+            trie__serialize_subtrie(fp, triep, trie__travel_link(triep, &nodep->travel, depth, i), depth+1);
+        }
+        break;
+    default:
+        assert(!"Unexpected NODE_TYPE");
+    }
+}
+
+/* Read one node into nodep, which covers the values starting at value. Rejects anything
+ * trie_serialize would not have produced, so a bad stream can't break the invariants
+ * the rest of the code relies on */
+static bool trie__deserialize_subtrie(FILE* fp, struct sTrie* triep, Node_t* nodep, uint16_t value, uint8_t depth, uint64_t* totalp) {
+    int tag = fgetc(fp);
+    uint64_t total = 0;
+    if(depth == TRIE_MAX_DEPTH) {
+        int bitmap = fgetc(fp);
+        /* Only the buckets for value and value+1 are ever used */
+        if(tag != TRIE_STREAM_TAG_COUNT || bitmap == EOF || (bitmap & ~0x3) != 0) {
+            return false;
+        }
+        uint64_t* bucketsp = (uint64_t*)nodep;
+        for(uint8_t i = 0; i < TRIE_COUNT_NODE_BUCKETS; i++) {
+            if((bitmap & (1 << i)) && (!trie__read_varint(fp, &bucketsp[i]) || bucketsp[i] == 0)) {
+                return false;
+            }
+            total += bucketsp[i];
+        }
+    } else if(tag == TRIE_STREAM_TAG_DATA) {
+        uint64_t used, delta;
+        uint32_t current = 0;
+        if(!trie__read_varint(fp, &used) || used >= NELEMS(nodep->data.data)) {
+            return false;
+        }
+        for(uint8_t i = 0; i < used; i++) {
+            if(!trie__read_varint(fp, &delta) || delta > USHRT_MAX || (current += delta) == 0 ||
+               current < value || current >= value + TRIE_SPAN_AT_DEPTH(depth)) {
+                return false;
+            }
+            nodep->data.data[31-i] = current;
+        }
+        total = used;
+    } else if(tag == TRIE_STREAM_TAG_TRAVEL && depth == TRIE_MAX_DEPTH - 1 && triep->config.compact_counts) {
+        /* Read the count nodes aside, they end up packed unless a counter is too large.
+         * The buckets are laid out just like a slab of packed count nodes */
+        uint64_t buckets[NELEMS(nodep->packed.count)] __attribute__((aligned(16))) = {0};
+        uint64_t largest = 0;
+        for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+            uint64_t child_total;
+            if(!trie__deserialize_subtrie(fp, triep, (Node_t*)&buckets[i * TRIE_COUNT_NODE_BUCKETS], value + ((uint16_t)i << GEN_SHIFT(depth)), depth+1, &child_total)) {
+                return false;
+            }
+            total += child_total;
+        }
+        for(uint8_t i = 0; i < NELEMS(buckets); i++) {
+            largest = buckets[i] > largest ? buckets[i] : largest;
+        }
+        if(largest <= UINT16_MAX) {
+            for(uint8_t i = 0; i < NELEMS(buckets); i++) {
+                nodep->packed.count[i] = buckets[i];
+            }
+            nodep->packed.marker = TRIE_PACKED_NODE_MARKER;
+        } else {
+            uint64_t totals[NELEMS(nodep->travel.link)];
+            TrieSlab_t slab = trie__alloc_slab(triep, value, depth);
+            memcpy(slab.nodes, buckets, sizeof(buckets));
+            for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+                totals[i] = buckets[2*i] + buckets[2*i + 1];
+            }
+            trie__write_travel_node(triep, &nodep->travel, slab, depth, totals);
+        }
+    } else if(tag == TRIE_STREAM_TAG_TRAVEL) {
+        uint64_t totals[NELEMS(nodep->travel.link)];
+        TrieSlab_t slab = trie__alloc_slab(triep, value, depth);
+        for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+            if(!trie__deserialize_subtrie(fp, triep, trie__slab_child(slab.nodes, depth, i), value + ((uint16_t)i << GEN_SHIFT(depth)), depth+1, &totals[i])) {
+                return false;
+            }
+            total += totals[i];
+        }
+        trie__write_travel_node(triep, &nodep->travel, slab, depth, totals);
+    } else {
+        return false;
+    }
+    *totalp = total;
+    return true;
+}
+
+int trie_serialize(struct sTrie* triep, FILE* fp) {
+    trie__hot_flush(triep);
+    fwrite(trie_stream_magic, sizeof(trie_stream_magic), 1, fp);
+    fputc(TRIE_STREAM_VERSION, fp);
+    trie__write_varint(fp, triep->number_of_zeros);
+    trie__serialize_subtrie(fp, triep, triep->base_node, 0);
+    return ferror(fp) ? -1 : 0;
+}
+
+struct sTrie* trie_deserialize(FILE* fp, const struct sTrieConfig* configp) {
+    char magic[sizeof(trie_stream_magic)];
+    uint64_t total;
+    if(fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, trie_stream_magic, sizeof(magic)) != 0 ||
+       fgetc(fp) != TRIE_STREAM_VERSION) {
+        return NULL;
+    }
+    struct sTrieConfig config = (configp != NULL) ? *configp : (struct sTrieConfig){0};
+    if(config.direct_levels > TRIE_DIRECT_LEVELS_MAX) {
+        return NULL;
+    }
+    /* The stream fills in fresh nodes, so a direct trie is read as a plain one first */
+    uint8_t direct_levels = config.direct_levels;
+    config.direct_levels = 0;
+    struct sTrie* triep = trie_init_ex(&config);
+    if(triep == NULL) {
+        return NULL;
+    }
+    if(!trie__read_varint(fp, &triep->number_of_zeros) ||
+       !trie__deserialize_subtrie(fp, triep, triep->base_node, 0, 0, &total)) {
+        trie_free(&triep);
+        return NULL;
+    }
+    if(direct_levels > 0) {
+        struct sTrie* direct_triep = trie_init_ex(configp);
+        if(direct_triep == NULL) {
+            trie_free(&triep);
+            return NULL;
+        }
+        trie_merge_into(direct_triep, triep);
+        trie_free(&triep);
+        triep = direct_triep;
+    }
+    return triep;
+}
+
+/* Images
+ * An image is a header followed by the nodes in pre-order, each travel node's subnodes
+ * in one slab followed by a count node with the link totals, exactly like a counted
+ * trie. The links are tagged byte offsets from the start of the node array, so the image
+ * can be queried in place wherever it is mapped. */
+typedef struct {
+    char magic[8];
+    uint64_t number_of_zeros;
+    uint64_t node_count;
+} CACHE_ALIGNED TrieImageHeader_t;
+
+static const char trie_image_magic[8] = {'B','T','R','I','M','G','0','1'};
+
+static uint64_t trie__image_node_count(struct sTrie* triep, Node_t* nodep, uint8_t depth) {
+    uint64_t count = 1;
+    switch(trie__determine_node_type(nodep, depth)) {
+    case NODE_TYPE_TRAVEL:
+        count += 1;
+        for(uint8_t i = 0; i < NELEMS(nodep->travel.link); i++) {
+            count += trie__image_node_count(triep, trie__travel_link(triep, &nodep->travel, depth, i), depth+1);
+        }
+        break;
+    case NODE_TYPE_PACKED:
+        /* Images expand packed nodes into a travel node over 8 count nodes */
+        count += 1 + NELEMS(nodep->travel.link);
+        break;
+    default:
+        break;
+    }
+    return count;
+}
+
+/* Copy the subtrie at srcp into image node dst_idx. Returns the number of values in it */
+static uint64_t trie__image_fill(struct sTrie* triep, Node_t* nodesp, uint64_t dst_idx, uint64_t* next_idxp, Node_t* srcp, uint8_t depth) {
+    uint64_t total = 0;
+    switch(trie__determine_node_type(srcp, depth)) {
+    case NODE_TYPE_COUNT:
+        /* Images keep every count node in a node of its own */
+        for(uint8_t i = 0; i < TRIE_COUNT_NODE_BUCKETS; i++) {
+            nodesp[dst_idx].count.count[i] = ((uint64_t*)srcp)[i];
+            total += ((uint64_t*)srcp)[i];
+        }
+        break;
+    case NODE_TYPE_DATA:
+        nodesp[dst_idx].data = srcp->data;
+        total = NELEMS(srcp->data.data) - trie__data_node_free_slots(&srcp->data);
+        break;
+    case NODE_TYPE_TRAVEL: {
+        uint64_t slab_idx = *next_idxp;
+        *next_idxp += NELEMS(srcp->travel.link) + 1;
+        for(uint8_t i = 0; i < NELEMS(srcp->travel.link); i++) {
+            uint64_t child_total = trie__image_fill(triep, nodesp, slab_idx + i, next_idxp, trie__travel_link(triep, &srcp->travel, depth, i), depth+1);
+            nodesp[slab_idx + NELEMS(srcp->travel.link)].count.count[i] = child_total;
+            total += child_total;
+            nodesp[dst_idx].travel.link[i] = TAG_PTR((Node_t*)((slab_idx + i) * sizeof(Node_t)));
+        }
+        break;
+    }
+    case NODE_TYPE_PACKED: {
+        uint64_t slab_idx = *next_idxp;
+        *next_idxp += NELEMS(srcp->travel.link) + 1;
+        for(uint8_t i = 0; i < NELEMS(srcp->travel.link); i++) {
+            uint64_t child_total = 0;
+            for(uint8_t b = 0; b < TRIE_COUNT_NODE_BUCKETS; b++) {
+                nodesp[slab_idx + i].count.count[b] = srcp->packed.count[i*TRIE_COUNT_NODE_BUCKETS + b];
+                child_total += srcp->packed.count[i*TRIE_COUNT_NODE_BUCKETS + b];
+            }
+            nodesp[slab_idx + NELEMS(srcp->travel.link)].count.count[i] = child_total;
+            total += child_total;
+            nodesp[dst_idx].travel.link[i] = TAG_PTR((Node_t*)((slab_idx + i) * sizeof(Node_t)));
+        }
+        break;
+    }
+    default:
+        assert(!"Unexpected NODE_TYPE");
+    }
+    return total;
+}
+
+int trie_image_write(struct sTrie* triep, FILE* fp) {
+    TrieImageHeader_t header;
+    trie__hot_flush(triep);
+    bzero(&header, sizeof(header));
+    memcpy(header.magic, trie_image_magic, sizeof(header.magic));
+    header.number_of_zeros = triep->number_of_zeros;
+    header.node_count = trie__image_node_count(triep, triep->base_node, 0);
+
+    Node_t* nodesp = aligned_alloc(CACHE_LINE_SIZE, header.node_count * sizeof(Node_t));
+    if(nodesp == NULL) {
+        return -1;
+    }
+    bzero(nodesp, header.node_count * sizeof(Node_t));
+    uint64_t next_idx = 1;
+    trie__image_fill(triep, nodesp, 0, &next_idx, triep->base_node, 0);
+    assert(next_idx == header.node_count);
+
+    int res = (fwrite(&header, sizeof(header), 1, fp) == 1 &&
+               fwrite(nodesp, sizeof(Node_t), header.node_count, fp) == header.node_count) ? 0 : -1;
+    free(nodesp);
+    return res;
+}
+
+bool trie_image_open(TrieImage_t* imagep, const void* bufp, size_t size) {
+    const TrieImageHeader_t* headerp = bufp;
+    if(((uintptr_t)bufp % CACHE_LINE_SIZE) != 0 || size < sizeof(*headerp) ||
+       memcmp(headerp->magic, trie_image_magic, sizeof(headerp->magic)) != 0 ||
+       headerp->node_count == 0 || headerp->node_count > (size - sizeof(*headerp)) / sizeof(Node_t)) {
+        return false;
+    }
+    imagep->nodes = (Node_t*)(headerp + 1);
+    imagep->node_count = headerp->node_count;
+    imagep->number_of_zeros = headerp->number_of_zeros;
+    return true;
+}
+
+static TrieReader_t trie__image_reader(const TrieImage_t* imagep) {
+    TrieReader_t reader = { .link_base = (uintptr_t)imagep->nodes, .counted = true, .counts_offset = NELEMS(((TravelNode_t*)0)->link) };
+    return reader;
+}
+
+uint64_t trie_image_count(const TrieImage_t* imagep, uint16_t value) {
+    if (value == 0) {
+        return imagep->number_of_zeros;
+    }
+    TrieReader_t reader = trie__image_reader(imagep);
+    return trie__count_subtrie_value(&reader, imagep->nodes, value);
+}
+
+uint64_t trie_image_count_range(const TrieImage_t* imagep, uint16_t lo, uint16_t hi) {
+    if (lo > hi) {
+        return 0;
+    }
+    TrieReader_t reader = trie__image_reader(imagep);
+    uint64_t count = (lo == 0) ? imagep->number_of_zeros : 0;
+    return count + trie__count_subtrie_range(&reader, imagep->nodes, 0, 0, lo, hi);
+}
+
+uint64_t trie_image_rank(const TrieImage_t* imagep, uint16_t value) {
+    return (value == 0) ? 0 : trie_image_count_range(imagep, 0, value-1);
+}
+
+uint16_t trie_image_quantile(const TrieImage_t* imagep, double q) {
+    TrieReader_t reader = trie__image_reader(imagep);
+    return trie__quantile(&reader, imagep->nodes, imagep->number_of_zeros, q);
+}
+
+/* Ingest
+ * Pipes and sockets go through two buffers. A reader thread fills one while the caller
+ * inserts the other, so the inserts overlap with waiting for the input */
+typedef struct {
+    int fd;
+    uint16_t* buffers[2];
+    size_t sizes[2];
+    bool full[2];
+    /* Set by the reader after the last block */
+    bool done;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} TrieIngest_t;
+
+/* Fill a whole block unless the input ends first. Returns the number of bytes read, or
+ * -1 on an error */
+static ssize_t trie__read_block(int fd, uint8_t* bufp, size_t size) {
+    size_t filled = 0;
+    while(filled < size) {
+        ssize_t n = read(fd, bufp + filled, size - filled);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            return -1;
+        }
+        if(n == 0) {
+            break;
+        }
+        filled += n;
+    }
+    return filled;
+}
+
+static void* trie__ingest_reader(void* argp) {
+    TrieIngest_t* ingestp = argp;
+    for(uint8_t b = 0; ; b ^= 1) {
+        pthread_mutex_lock(&ingestp->lock);
+        while(ingestp->full[b] && !ingestp->failed) {
+            pthread_cond_wait(&ingestp->changed, &ingestp->lock);
+        }
+        bool stop = ingestp->failed;
+        pthread_mutex_unlock(&ingestp->lock);
+        ssize_t n = stop ? 0 : trie__read_block(ingestp->fd, (uint8_t*)ingestp->buffers[b], TRIE_INGEST_BLOCK_SIZE);
+        pthread_mutex_lock(&ingestp->lock);
+        if(n < 0 || n % sizeof(uint16_t) != 0) {
+            ingestp->failed = true;
+        }
+        /* The whole values in front of an odd byte at the end still go in */
+        if(n > 1) {
+            ingestp->sizes[b] = n & ~(ssize_t)(sizeof(uint16_t) - 1);
+            ingestp->full[b] = true;
+        }
+        if(n < TRIE_INGEST_BLOCK_SIZE || ingestp->failed) {
+            ingestp->done = true;
+        }
+        pthread_cond_broadcast(&ingestp->changed);
+        pthread_mutex_unlock(&ingestp->lock);
+        if(ingestp->done) {
+            return NULL;
+        }
+    }
+}
+
+static int trie__insert_stream(struct sTrie* trie_ctxp, int fd) {
+    TrieIngest_t ingest = { .fd = fd };
+    pthread_t reader;
+    for(uint8_t b = 0; b < NELEMS(ingest.buffers); b++) {
+        ingest.buffers[b] = malloc(TRIE_INGEST_BLOCK_SIZE);
+        assert(ingest.buffers[b] != NULL);
+    }
+    pthread_mutex_init(&ingest.lock, NULL);
+    pthread_cond_init(&ingest.changed, NULL);
+    bool threaded = (pthread_create(&reader, NULL, trie__ingest_reader, &ingest) == 0);
+    while(!threaded) {
+        /* Read and insert in turn then */
+        ssize_t n = trie__read_block(fd, (uint8_t*)ingest.buffers[0], TRIE_INGEST_BLOCK_SIZE);
+        if(n > 1) {
+            trie_insert_values(trie_ctxp, ingest.buffers[0], n / sizeof(uint16_t));
+        }
+        ingest.failed = (n < 0 || n % sizeof(uint16_t) != 0);
+        if(n < TRIE_INGEST_BLOCK_SIZE) {
+            break;
+        }
+    }
+    for(uint8_t b = 0; threaded; b ^= 1) {
+        pthread_mutex_lock(&ingest.lock);
+        while(!ingest.full[b] && !ingest.done) {
+            pthread_cond_wait(&ingest.changed, &ingest.lock);
+        }
+        if(!ingest.full[b]) {
+            pthread_mutex_unlock(&ingest.lock);
+            break;
+        }
+        pthread_mutex_unlock(&ingest.lock);
+        trie_insert_values(trie_ctxp, ingest.buffers[b], ingest.sizes[b] / sizeof(uint16_t));
+        pthread_mutex_lock(&ingest.lock);
+        ingest.full[b] = false;
+        pthread_cond_broadcast(&ingest.changed);
+        pthread_mutex_unlock(&ingest.lock);
+    }
+    if(threaded) {
+        pthread_join(reader, NULL);
+    }
+    pthread_cond_destroy(&ingest.changed);
+    pthread_mutex_destroy(&ingest.lock);
+    for(uint8_t b = 0; b < NELEMS(ingest.buffers); b++) {
+        free(ingest.buffers[b]);
+    }
+    return ingest.failed ? -1 : 0;
+}
+
+int trie_insert_fd(struct sTrie* trie_ctxp, int fd) {
+    struct stat st;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || offset < 0 || offset >= st.st_size) {
+        return trie__insert_stream(trie_ctxp, fd);
+    }
+    /* Map the rest of the file and let the kernel read ahead of the inserts */
+    size_t size = st.st_size - offset;
+    uint8_t* mapp = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(mapp == MAP_FAILED) {
+        return trie__insert_stream(trie_ctxp, fd);
+    }
+    madvise(mapp, st.st_size, MADV_SEQUENTIAL);
+    /* The values are only aligned if the offset is */
+    int res = (size % sizeof(uint16_t) == 0) ? 0 : -1;
+    size_t n = size / sizeof(uint16_t);
+    if(offset % sizeof(uint16_t) == 0) {
+        trie_insert_values(trie_ctxp, (const uint16_t*)(mapp + offset), n);
+    } else {
+        uint16_t block[TRIE_BATCH_BLOCK_SIZE];
+        for(size_t i = 0; i < n; i += NELEMS(block)) {
+            size_t count = (n - i < NELEMS(block)) ? n - i : NELEMS(block);
+            memcpy(block, mapp + offset + i * sizeof(uint16_t), count * sizeof(uint16_t));
+            trie_insert_values(trie_ctxp, block, count);
+        }
+    }
+    munmap(mapp, st.st_size);
+    lseek(fd, 0, SEEK_END);
+    return res;
+}
+
+/* Windows
+ * The intervals are separate tries, so a window query adds up the answers of each of
+ * them. Quantiles search for the value whose rank over the window is the target */
+struct sTrieWindow* trie_window_init(uint32_t interval_count, const struct sTrieConfig* configp) {
+    if(interval_count == 0) {
+        return NULL;
+    }
+    struct sTrieWindow* windowp = calloc(1, sizeof(*windowp));
+    assert(windowp != NULL);
+    windowp->intervals = calloc(interval_count, sizeof(*windowp->intervals));
+    assert(windowp->intervals != NULL);
+    windowp->interval_count = interval_count;
+    for(uint32_t i = 0; i < interval_count; i++) {
+        windowp->intervals[i] = trie_init_ex(configp);
+        if(windowp->intervals[i] == NULL) {
+            trie_window_free(&windowp);
+            return NULL;
+        }
+    }
+    return windowp;
+}
+
+void trie_window_free(struct sTrieWindow** windowpp) {
+    for(uint32_t i = 0; i < (*windowpp)->interval_count; i++) {
+        if((*windowpp)->intervals[i] != NULL) {
+            trie_free(&(*windowpp)->intervals[i]);
+        }
+    }
+    free((*windowpp)->intervals);
+    free(*windowpp);
+    *windowpp = NULL;
+}
+
+void trie_window_rotate(struct sTrieWindow* windowp) {
+    windowp->current = (windowp->current + 1) % windowp->interval_count;
+    trie_reset(windowp->intervals[windowp->current]);
+}
+
+struct sTrie* trie_window_current(struct sTrieWindow* windowp) {
+    return windowp->intervals[windowp->current];
+}
+
+void trie_window_insert_value(struct sTrieWindow* windowp, uint16_t value) {
+    trie_insert_value(trie_window_current(windowp), value);
+}
+
+void trie_window_insert_values(struct sTrieWindow* windowp, const uint16_t* values, size_t n) {
+    trie_insert_values(trie_window_current(windowp), values, n);
+}
+
+uint64_t trie_window_count(struct sTrieWindow* windowp, uint16_t value) {
+    uint64_t count = 0;
+    for(uint32_t i = 0; i < windowp->interval_count; i++) {
+        count += trie_count(windowp->intervals[i], value);
+    }
+    return count;
+}
+
+uint64_t trie_window_count_range(struct sTrieWindow* windowp, uint16_t lo, uint16_t hi) {
+    uint64_t count = 0;
+    for(uint32_t i = 0; i < windowp->interval_count; i++) {
+        count += trie_count_range(windowp->intervals[i], lo, hi);
+    }
+    return count;
+}
+
+uint64_t trie_window_rank(struct sTrieWindow* windowp, uint16_t value) {
+    return (value == 0) ? 0 : trie_window_count_range(windowp, 0, value-1);
+}
+
+uint16_t trie_window_quantile(struct sTrieWindow* windowp, double q) {
+    uint64_t total = trie_window_count_range(windowp, 0, USHRT_MAX);
+    if(total == 0) {
+        return 0;
+    }
+    /* Same nearest rank as trie_quantile */
+    q = (q > 1.0) ? 1.0 : (q > 0.0) ? q : 0.0;
+    double target = q * (double)total;
+    uint64_t rank = (uint64_t)target;
+    if((double)rank < target) {
+        ++rank;
+    }
+    rank = (rank == 0) ? 1 : (rank > total) ? total : rank;
+    /* The smallest value with at least rank values at or below it */
+    uint32_t lo = 0, hi = USHRT_MAX;
+    while(lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if(trie_window_count_range(windowp, 0, mid) >= rank) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/* The wide tries, declared at the end of trie.h */
+#define TRIE_WIDE_TYPE Trie32
+#define TRIE_WIDE_PREFIX trie32
+#define TRIE_WIDE_KEY uint32_t
+#define TRIE_WIDE_LEVEL_BITS 3
+#include "trie.wide.impl.h"
+
+#define TRIE_WIDE_TYPE Trie64
+#define TRIE_WIDE_PREFIX trie64
+#define TRIE_WIDE_KEY uint64_t
+#define TRIE_WIDE_LEVEL_BITS 3
+#include "trie.wide.impl.h"
+
+#define TRIE_WIDE_TYPE Trie16x16
+#define TRIE_WIDE_PREFIX trie16x16
+#define TRIE_WIDE_KEY uint16_t
+#define TRIE_WIDE_LEVEL_BITS 4
+#include "trie.wide.impl.h"
+
+#define TRIE_WIDE_TYPE Trie16x64
+#define TRIE_WIDE_PREFIX trie16x64
+#define TRIE_WIDE_KEY uint16_t
+#define TRIE_WIDE_LEVEL_BITS 6
+#include "trie.wide.impl.h"
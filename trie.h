@@ -1,3 +1,5 @@
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -16,20 +18,355 @@ typedef struct {
     uint64_t count[8];
 } CACHE_ALIGNED CountNode_t;
 
+/* The last travel level and the count nodes under it folded into one node, with a 16 bit
+ * counter for each of the 16 values it covers. marker tells it apart from the other node
+ * types */
+typedef struct {
+    uint64_t marker;
+    uint16_t count[16];
+} CACHE_ALIGNED PackedNode_t;
+
+/* Travel node of a trie with compact links. slab is the tagged arena index of the
+ * first subnode, the rest of the node holds the 8 link totals of a counted trie as
+ * 56 bit numbers */
+typedef struct {
+    uint32_t slab;
+    uint8_t totals[60];
+} CACHE_ALIGNED CompactTravelNode_t;
+
 typedef struct sNode {
     union {
         DataNode_t data;
         TravelNode_t travel;
         CountNode_t count;
+        PackedNode_t packed;
+        CompactTravelNode_t compact;
     };  
 } CACHE_ALIGNED Node_t;
 
+/* Deepest the direct table can reach, leaving at least one level of travel nodes
+ * above the count nodes */
+#define TRIE_DIRECT_LEVELS_MAX 4
+
+typedef struct sTrieConfig {
+    /* Keep the number of values under each travel link, so trie_rank and trie_quantile
+     * only walk a single path. Costs one count node per travel node and some upkeep
+     * on every insert. */
+    bool counted;
+    /* Allow trie_insert_value_concurrent. Bursts then take a lock on the arena */
+    bool concurrent;
+    /* Lay the nodes out vertically: every top level subtrie gets its own arena lane,
+     * so the nodes on one walk from the base node down sit close together instead of
+     * being spread over the whole arena. Costs up to one extra arena chunk per lane */
+    bool vertical;
+    /* Have trie_insert_values walk several values down the trie at once, so the cache
+     * misses of one walk overlap with the others. This only pays off once the trie has
+     * outgrown the caches close to the core, below that it is slower */
+    bool interleaved;
+    /* Burst the top direct_levels levels up front and keep a flat table of the
+     * 8^direct_levels subtries below them, so the single value inserts skip straight
+     * past those levels. At most TRIE_DIRECT_LEVELS_MAX, trie_init_ex returns NULL
+     * for anything deeper */
+    uint8_t direct_levels;
+    /* Start the counters of the last levels at 16 bits, packed into a single node. A
+     * packed node moves to the 64 bit count nodes the first time one of its counters
+     * would overflow. Can't be combined with concurrent, trie_init_ex returns NULL */
+    bool compact_counts;
+    /* Link the subnodes of a travel node with a 32 bit index into the arena instead of 8
+     * pointers, which leaves room for the link totals in the travel node itself. Can't
+     * be combined with concurrent, trie_init_ex returns NULL */
+    bool compact_links;
+    /* Count the values seen most often in a small table in front of the trie, so their
+     * inserts don't walk it at all. The table takes values in and out as the inserts
+     * go. Only pays off when a handful of values make up most of the inserts, every
+     * other insert gets a little slower. The counts held back in the table go into the
+     * trie on the first query after an insert, so queries write to the trie and two of
+     * them can't run at once. Call trie_flush from the inserting thread before handing
+     * the trie to several readers, after that queries only read it. Can't be combined
+     * with concurrent, trie_init_ex returns NULL */
+    bool hot_values;
+} TrieConfig_t;
+
+typedef struct sTrieArenaChunk {
+    struct sTrieArenaChunk* next;
+    size_t size;
+    /* Position in the chunk table of a trie with compact links */
+    uint32_t index;
+} TrieArenaChunk_t;
+
+/* All the nodes of a trie are carved out of its arena */
+typedef struct sTrieArena {
+    struct sTrieArenaChunk* chunks;
+    struct sTrieArenaChunk* current;
+    uint8_t* cursor;
+    size_t bytes_reserved;
+    size_t bytes_used;
+} TrieArena_t;
+
+/* Number of levels from the base node down to the count nodes */
+#define TRIE_LEVELS 6
+
+/* Insert path counters. They only move when trie.c is built with TRIE_STATS defined,
+ * but they are always there so the layout of sTrie does not depend on the flag */
+typedef struct sTrieCounters {
+    /* Data nodes turned into travel nodes, by the depth of the node */
+    uint64_t bursts[TRIE_LEVELS];
+    /* Bursts that left every element in one subnode, which had to burst again */
+    uint64_t cascading_bursts;
+    /* Packed nodes moved to 64 bit counters */
+    uint64_t promotions;
+    /* Inserts counted in the hot value table */
+    uint64_t hot_hits;
+    /* Travel and packed nodes turned back into data nodes by removals and compaction */
+    uint64_t collapses;
+    /* Walks from the top of the trie down to a data or count node, and the depths
+     * they ended at. Zeros never walk the trie */
+    uint64_t descents;
+    uint64_t descent_depth_total;
+} TrieCounters_t;
+
+#define TRIE_HOT_VALUES 16
+
+/* The hot value table, one cache line. Empty slots hold 0. An insert of a value in the
+ * table only bumps its pending count, which goes into the trie before anything reads
+ * the trie */
+typedef struct sTrieHotValues {
+    uint16_t value[TRIE_HOT_VALUES];
+    uint16_t pending[TRIE_HOT_VALUES];
+} CACHE_ALIGNED TrieHotValues_t;
+
+/* One lane per link of the base node */
+#define TRIE_ARENA_LANES 8
+
 typedef struct sTrie {
     Node_t* base_node;
     uint64_t number_of_zeros;
+    struct sTrieConfig config;
+    struct sTrieArena arena;
+    /* Only used by vertical tries, the base node slab stays in arena */
+    struct sTrieArena lanes[TRIE_ARENA_LANES];
+    uint32_t arena_lock;
+    struct sTrieCounters counters;
+    /* The subtries below the direct levels, NULL unless the trie has them. A counted
+     * trie also keeps the direct_levels travel nodes on the way down to each subtrie,
+     * whose link totals an insert into it has to bump */
+    struct sNode** direct;
+    struct sNode** direct_path;
+    /* Every arena chunk a compact link can point into, from all the arenas */
+    struct sTrieArenaChunk** chunk_table;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+    /* Slabs of collapsed travel nodes by depth, reused by the next bursts */
+    struct sTrieFreeSlab* free_slabs[TRIE_LEVELS];
+    size_t free_slab_bytes;
+    /* Set on snapshots, every call that changes the trie asserts it is clear */
+    bool read_only;
+    /* Next trie waiting for the reclaimer thread of trie_free_async */
+    struct sTrie* reclaim_next;
+    /* Hot values and how often each was hit lately, for replacing them clock style */
+    TrieHotValues_t hot;
+    uint8_t hot_hits[TRIE_HOT_VALUES];
+    uint8_t hot_hand;
+    uint8_t hot_misses;
 } Trie_t;
 
+/* Filled in by trie_get_stats */
+typedef struct sTrieStats {
+    uint64_t data_nodes;
+    uint64_t travel_nodes;
+    uint64_t count_nodes;
+    uint64_t packed_nodes;
+    /* Count nodes holding the per link totals of a counted trie, compact links keep
+     * them in the travel nodes instead */
+    uint64_t total_nodes;
+    size_t bytes_reserved;
+    /* Not counting the slabs waiting on the free list */
+    size_t bytes_used;
+    /* Share of the data node slots that hold a value */
+    double data_fill_factor;
+    /* False if the counters below were compiled out */
+    bool counters_enabled;
+    struct sTrieCounters counters;
+    double average_descent_depth;
+} TrieStats_t;
+
+/* Deep enough for the longest path from the base node down to a count node */
+#define TRIE_ITER_STACK_DEPTH TRIE_LEVELS
+
+/* In order cursor over the distinct values of a trie. Any insert into the trie
+ * invalidates it. */
+typedef struct sTrieIter {
+    struct sTrie* trie;
+    bool zeros_pending;
+    int8_t depth;
+    /* Depth of the node the walk started from */
+    int8_t top;
+    struct sNode* node[TRIE_ITER_STACK_DEPTH];
+    uint16_t value[TRIE_ITER_STACK_DEPTH];
+    uint8_t position[TRIE_ITER_STACK_DEPTH];
+} TrieIter_t;
+
+/* A read only trie image laid out by trie_image_write. It points into the caller's
+ * buffer, which would usually be an mmap of the file */
+typedef struct sTrieImage {
+    struct sNode* nodes;
+    uint64_t node_count;
+    uint64_t number_of_zeros;
+} TrieImage_t;
+
+/* Rolling histogram over the last intervals, one trie per interval in a ring. Rotating
+ * empties the oldest trie with trie_reset so its arena is reused, not freed */
+typedef struct sTrieWindow {
+    struct sTrie** intervals;
+    uint32_t interval_count;
+    /* The interval inserts go to */
+    uint32_t current;
+} TrieWindow_t;
+
+/* Called once per distinct value in sorted order. Return false to stop the walk */
+typedef bool (*TrieVisitor_t)(void* ctxp, uint16_t value, uint64_t count);
+
 struct sTrie* trie_init(void);
+/* configp may be NULL, which is the same as trie_init */
+struct sTrie* trie_init_ex(const struct sTrieConfig* configp);
 void trie_free(struct sTrie**);
+/* Like trie_free, but the memory is given back by a reclaimer thread so the caller
+ * does not wait for it. *triepp is NULL on return either way */
+void trie_free_async(struct sTrie** triepp);
+/* Wait until every trie passed to trie_free_async so far has been freed */
+void trie_free_async_wait(void);
+/* Empty the trie but keep its memory around for the next round of inserts */
+void trie_reset(struct sTrie* triep);
+/* Move the counts a hot_values trie holds back into the trie proper, so queries until
+ * the next insert don't write to it. Does nothing for other tries */
+void trie_flush(struct sTrie* triep);
 void trie_insert_value(struct sTrie* trie_ctxp, uint16_t value);
+/* Insert value n times. Walks the trie once instead of n times */
+void trie_insert_value_n(struct sTrie* trie_ctxp, uint16_t value, uint64_t n);
+/* Insert n values at once. Equivalent to calling trie_insert_value on each of them */
+void trie_insert_values(struct sTrie* trie_ctxp, const uint16_t* values, size_t n);
+/* Remove up to n copies of value and return how many there were. A travel node whose
+ * subtrie fits in a data node again turns back into one. Not safe to call while a
+ * concurrent trie is being inserted into */
+uint64_t trie_remove_value_n(struct sTrie* trie_ctxp, uint16_t value, uint64_t n);
+/* Returns false if value was not in the trie */
+bool trie_remove_value(struct sTrie* trie_ctxp, uint16_t value);
+/* Remove every value in src from dst as many times as src holds it, or as many times
+ * as dst holds it if that is fewer */
+void trie_subtract(struct sTrie* dst_triep, struct sTrie* src_triep);
+/* Same as trie_insert_value, but safe to call from several threads at once on a trie
+ * created with the concurrent option. Everything else, including queries, still needs
+ * the inserting threads to be quiet. */
+void trie_insert_value_concurrent(struct sTrie* trie_ctxp, uint16_t value);
+/* Add every value in src into dst. src is left untouched and the two tries may
+ * have different configurations */
+void trie_merge_into(struct sTrie* dst_triep, struct sTrie* src_triep);
+/* A compacted, read only copy of the trie that other threads can query while inserts
+ * into the source carry on. This is a full copy, O(size of the trie), and not a copy on
+ * write view: the inserts have to pause while it is taken, so take it from the thread
+ * that inserts, or while the inserting threads of a concurrent trie are quiet. That is
+ * a millisecond or two for a trie that holds every value. The copy is counted and
+ * compact like the source but has none of its insert options. Inserts into it, and
+ * anything else that changes it, fail an assert. Release it with trie_free or
+ * trie_free_async */
+struct sTrie* trie_snapshot(struct sTrie* triep);
+/* Number of values a and b have in common. A value inserted x times into a and y
+ * times into b counts min(x, y) times */
+uint64_t trie_intersect_count(struct sTrie* a_triep, struct sTrie* b_triep);
+/* A new trie holding every value of the n tries as many times as all of them together.
+ * configp may be NULL. Returns NULL if trie_init_ex would */
+struct sTrie* trie_union(struct sTrie* const* triepp, size_t n, const struct sTrieConfig* configp);
+/* Fill valuesp and countsp with the k distinct values that have the highest count
+ * summed over the n tries, highest first and smaller values first on a tie. Returns
+ * how many there were, at most k. Subtries whose link totals show they can't make it
+ * are skipped, so counted tries are much faster */
+size_t trie_top_k(struct sTrie* const* triepp, size_t n, size_t k, uint16_t* valuesp, uint64_t* countsp);
+/* Rebuild the trie into one block of memory with every travel node's subnodes right
+ * after it in depth first order, for a read mostly phase after the inserts. Subtries
+ * that fit in a data node become one, and the old nodes are freed. Inserts can carry
+ * on afterwards. Not safe to call while a concurrent trie is being inserted into */
+void trie_compact(struct sTrie* triep);
 void trie_print_values(struct sTrie* triep, FILE* fp);
+/* Same output as trie_print_values, written by threads workers that each take the
+ * subtries a few levels down one at a time. 0 threads uses every online CPU. Returns 0
+ * on success and -1 on an error */
+int trie_print_values_parallel(struct sTrie* triep, FILE* fp, unsigned threads);
+/* Walks the whole trie, so it is not meant for the hot path */
+void trie_get_stats(struct sTrie* triep, TrieStats_t* statsp);
+/* Number of times value has been inserted */
+uint64_t trie_count(struct sTrie* triep, uint16_t value);
+/* Number of inserted values v with lo <= v <= hi */
+uint64_t trie_count_range(struct sTrie* triep, uint16_t lo, uint16_t hi);
+/* Number of inserted values strictly smaller than value */
+uint64_t trie_rank(struct sTrie* triep, uint16_t value);
+/* Nearest rank quantile for 0 <= q <= 1. Returns 0 for an empty trie */
+uint16_t trie_quantile(struct sTrie* triep, double q);
+
+void trie_iter_init(struct sTrie* triep, TrieIter_t* iterp);
+/* Returns false once every value has been reported */
+bool trie_iter_next(TrieIter_t* iterp, uint16_t* valuep, uint64_t* countp);
+/* Returns false if the visitor stopped the walk early */
+bool trie_visit(struct sTrie* triep, TrieVisitor_t visitor, void* ctxp);
+
+/* Insert every sample read from fd until end of file. The input is native endian
+ * uint16_t values, so its size has to be even. Regular files are mapped, anything else
+ * is read block by block while the previous block is inserted. Returns 0 on success
+ * and -1 on a read error or an odd number of bytes, after inserting what came before */
+int trie_insert_fd(struct sTrie* trie_ctxp, int fd);
+
+/* Compact binary encoding. Returns 0 on success and -1 on a write error */
+int trie_serialize(struct sTrie* triep, FILE* fp);
+/* Returns NULL if the stream is not a valid encoding. configp may be NULL */
+struct sTrie* trie_deserialize(FILE* fp, const struct sTrieConfig* configp);
+
+/* Write an image that trie_image_open can use in place. Returns 0 on success */
+int trie_image_write(struct sTrie* triep, FILE* fp);
+/* bufp must be cache line aligned, as mmap is. Only the header is checked, so the
+ * image has to come from trie_image_write */
+bool trie_image_open(TrieImage_t* imagep, const void* bufp, size_t size);
+uint64_t trie_image_count(const TrieImage_t* imagep, uint16_t value);
+uint64_t trie_image_count_range(const TrieImage_t* imagep, uint16_t lo, uint16_t hi);
+uint64_t trie_image_rank(const TrieImage_t* imagep, uint16_t value);
+uint16_t trie_image_quantile(const TrieImage_t* imagep, double q);
+
+/* Window of interval_count tries created with configp, which may be NULL. Returns NULL
+ * if interval_count is 0 or trie_init_ex rejects the config */
+struct sTrieWindow* trie_window_init(uint32_t interval_count, const struct sTrieConfig* configp);
+void trie_window_free(struct sTrieWindow** windowpp);
+/* Start a new interval, dropping the values of the oldest one */
+void trie_window_rotate(struct sTrieWindow* windowp);
+/* The trie of the current interval, for any of the insert functions */
+struct sTrie* trie_window_current(struct sTrieWindow* windowp);
+void trie_window_insert_value(struct sTrieWindow* windowp, uint16_t value);
+void trie_window_insert_values(struct sTrieWindow* windowp, const uint16_t* values, size_t n);
+/* The queries cover every interval in the window */
+uint64_t trie_window_count(struct sTrieWindow* windowp, uint16_t value);
+uint64_t trie_window_count_range(struct sTrieWindow* windowp, uint16_t lo, uint16_t hi);
+uint64_t trie_window_rank(struct sTrieWindow* windowp, uint16_t value);
+uint16_t trie_window_quantile(struct sTrieWindow* windowp, double q);
+
+/* Tries over 32 and 64 bit keys, and 16 bit tries with 16 and 64 way travel nodes. See
+ * trie.wide.h */
+#define TRIE_WIDE_TYPE Trie32
+#define TRIE_WIDE_PREFIX trie32
+#define TRIE_WIDE_KEY uint32_t
+#define TRIE_WIDE_LEVEL_BITS 3
+#include "trie.wide.h"
+
+#define TRIE_WIDE_TYPE Trie64
+#define TRIE_WIDE_PREFIX trie64
+#define TRIE_WIDE_KEY uint64_t
+#define TRIE_WIDE_LEVEL_BITS 3
+#include "trie.wide.h"
+
+#define TRIE_WIDE_TYPE Trie16x16
+#define TRIE_WIDE_PREFIX trie16x16
+#define TRIE_WIDE_KEY uint16_t
+#define TRIE_WIDE_LEVEL_BITS 4
+#include "trie.wide.h"
+
+#define TRIE_WIDE_TYPE Trie16x64
+#define TRIE_WIDE_PREFIX trie16x64
+#define TRIE_WIDE_KEY uint16_t
+#define TRIE_WIDE_LEVEL_BITS 6
+#include "trie.wide.h"
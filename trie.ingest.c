@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "trie.h"
+
+/* Ingest tool
+ * Usage: trie.ingest.exe [-o values|pairs|stream|image] [-c] [file...]
+ * Builds a trie from native endian uint16_t samples in the files, or stdin if there
+ * are none or a file is "-", and writes it to stdout:
+ *  values  every sample in order, like trie_print_values (the default)
+ *  pairs   one "value count" line per distinct value
+ *  stream  the trie_serialize encoding
+ *  image   a trie_image_write image
+ * -c builds a counted trie. */
+
+typedef enum {
+    INGEST_OUTPUT_VALUES,
+    INGEST_OUTPUT_PAIRS,
+    INGEST_OUTPUT_STREAM,
+    INGEST_OUTPUT_IMAGE
+} IngestOutput_t;
+
+static bool ingest_print_pair(void* ctxp, uint16_t value, uint64_t count) {
+    return fprintf((FILE*)ctxp, "%u %lu\n", value, (unsigned long)count) > 0;
+}
+
+static void ingest_usage(const char* namep) {
+    fprintf(stderr, "usage: %s [-o values|pairs|stream|image] [-c] [file...]\n", namep);
+    exit(EXIT_FAILURE);
+}
+
+static bool ingest_file(struct sTrie* triep, const char* pathp) {
+    int fd = (strcmp(pathp, "-") == 0) ? STDIN_FILENO : open(pathp, O_RDONLY);
+    if(fd < 0) {
+        perror(pathp);
+        return false;
+    }
+    bool ok = (trie_insert_fd(triep, fd) == 0);
+    if(!ok) {
+        fprintf(stderr, "%s: read error or odd number of bytes\n", pathp);
+    }
+    if(fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    IngestOutput_t output = INGEST_OUTPUT_VALUES;
+    struct sTrieConfig config = {0};
+    int opt;
+    while((opt = getopt(argc, argv, "o:c")) != -1) {
+        if(opt == 'c') {
+            config.counted = true;
+        } else if(opt == 'o' && strcmp(optarg, "values") == 0) {
+            output = INGEST_OUTPUT_VALUES;
+        } else if(opt == 'o' && strcmp(optarg, "pairs") == 0) {
+            output = INGEST_OUTPUT_PAIRS;
+        } else if(opt == 'o' && strcmp(optarg, "stream") == 0) {
+            output = INGEST_OUTPUT_STREAM;
+        } else if(opt == 'o' && strcmp(optarg, "image") == 0) {
+            output = INGEST_OUTPUT_IMAGE;
+        } else {
+            ingest_usage(argv[0]);
+        }
+    }
+
+    struct sTrie* triep = trie_init_ex(&config);
+    bool ok = true;
+    if(optind == argc) {
+        ok = ingest_file(triep, "-");
+    }
+    for(int i = optind; ok && i < argc; i++) {
+        ok = ingest_file(triep, argv[i]);
+    }
+    if(ok) {
+        switch(output) {
+        case INGEST_OUTPUT_VALUES:
+            trie_print_values(triep, stdout);
+            break;
+        case INGEST_OUTPUT_PAIRS:
+            trie_visit(triep, ingest_print_pair, stdout);
+            break;
+        case INGEST_OUTPUT_STREAM:
+            ok = (trie_serialize(triep, stdout) == 0);
+            break;
+        case INGEST_OUTPUT_IMAGE:
+            ok = (trie_image_write(triep, stdout) == 0);
+            break;
+        }
+        ok = (fflush(stdout) == 0) && !ferror(stdout) && ok;
+    }
+    trie_free(&triep);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
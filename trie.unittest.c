@@ -2,6 +2,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
 /* MinUnit test framework - see http://www.jera.com/techinfo/jtns/jtn002.html */
  #define mu_assert(message, test) do { if (!(test)) return message; } while (0)
  #define mu_run_test(test) do { char *message = test(); tests_run++; \
@@ -9,6 +15,9 @@
 int tests_run = 0;
 /* End of MinUnit */
 
+#define NELEMS( _x ) \
+    ( sizeof( _x ) / sizeof( *_x ) )
+
 #define SETUP \
     struct sTrie* triep = trie_init();
 #define TEARDOWN \
@@ -29,6 +38,32 @@ int tests_run = 0;
 #define INS(_val) \
     trie_insert_value(triep, _val);
 
+/* Small deterministic generator so the bulk tests are reproducible */
+static uint16_t next_random(uint32_t* statep) {
+    *statep = *statep * 1103515245 + 12345;
+    return (uint16_t)(*statep >> 16);
+}
+
+static char * trie_to_string(struct sTrie* triep, size_t* sizep) {
+    char * bytp;
+    FILE* fp = open_memstream(&bytp, sizep);
+    trie_print_values(triep, fp);
+    fclose(fp);
+    return bytp;
+}
+
+/* trie_image_open wants a cache line aligned image, which a memory stream doesn't promise */
+static void * image_to_buffer(struct sTrie* triep, size_t* sizep) {
+    char * bytp;
+    FILE* fp = open_memstream(&bytp, sizep);
+    int res = trie_image_write(triep, fp);
+    fclose(fp);
+    void* alignedp = aligned_alloc(64, (*sizep + 63) & ~(size_t)63);
+    memcpy(alignedp, bytp, *sizep);
+    free(bytp);
+    return (res == 0) ? alignedp : NULL;
+}
+
 static char * test_simple() {
     SETUP
     
@@ -184,11 +219,1834 @@ static char * test_low_number_to_same_bucket_after_burst() {
     TEARDOWN
 }
     
+static char * test_batch_insert() {
+    SETUP
+
+    const uint16_t values[] = {0, 1, 65535, 2, 3, 5, 1, 8, 0, 8, 13, 65535, 90, 40000};
+    trie_insert_values(triep, values, NELEMS(values));
+
+    EXPECT_TRIE("0 0 1 1 2 3 5 8 8 13 90 40000 65535 65535 ");
+
+    TEARDOWN
+}
+
+static char * test_batch_insert_matches_single_inserts() {
+    SETUP
+    struct sTrie* single_triep = trie_init();
+    uint32_t state = 42;
+    /* Spans several partition blocks and bursts the top of the trie part way through */
+    const size_t n = 100000;
+    uint16_t* values = malloc(n * sizeof(*values));
+    for(size_t i = 0; i < n; i++) {
+        /* Clustered values force cascading bursts as well */
+        values[i] = (i % 3 == 0) ? (next_random(&state) & 0x3F) : next_random(&state);
+        trie_insert_value(single_triep, values[i]);
+    }
+    trie_insert_values(triep, values, 7);
+    trie_insert_values(triep, values + 7, n - 7);
+
+    size_t batch_size, single_size;
+    char * batch_bytp = trie_to_string(triep, &batch_size);
+    char * single_bytp = trie_to_string(single_triep, &single_size);
+    mu_assert("error, size mismatch", batch_size == single_size);
+    mu_assert("error, string mismatch", memcmp(batch_bytp, single_bytp, batch_size) == 0);
+    free(batch_bytp);
+    free(single_bytp);
+    free(values);
+    trie_free(&single_triep);
+
+    TEARDOWN
+}
+
+static char * test_count() {
+    SETUP
+
+    INS(0)
+    INS(0)
+    INS(7)
+    INS(65535)
+    for(int i = 0; i < 40; i++) {
+        INS(1)
+    }
+    INS(2)
+
+    mu_assert("error, zeros", trie_count(triep, 0) == 2);
+    mu_assert("error, count bucket", trie_count(triep, 1) == 40);
+    mu_assert("error, data node", trie_count(triep, 7) == 1);
+    mu_assert("error, absent value", trie_count(triep, 3) == 0);
+    mu_assert("error, last value", trie_count(triep, 65535) == 1);
+    mu_assert("error, full range", trie_count_range(triep, 0, 65535) == 45);
+    mu_assert("error, zero range", trie_count_range(triep, 0, 0) == 2);
+    mu_assert("error, inner range", trie_count_range(triep, 1, 2) == 41);
+    mu_assert("error, empty range", trie_count_range(triep, 8, 65534) == 0);
+    mu_assert("error, reversed range", trie_count_range(triep, 5, 4) == 0);
+
+    TEARDOWN
+}
+
+static char * test_count_range_matches_oracle() {
+    SETUP
+    uint64_t* oraclep = calloc(65536, sizeof(*oraclep));
+    uint32_t state = 7;
+    for(int i = 0; i < 50000; i++) {
+        uint16_t value = (i % 2) ? (next_random(&state) & 0x1FF) : next_random(&state);
+        INS(value)
+        ++oraclep[value];
+    }
+    for(int i = 0; i < 200; i++) {
+        uint16_t lo = next_random(&state);
+        uint16_t hi = (i % 4) ? lo + (next_random(&state) & 0x3FF) : next_random(&state);
+        uint64_t expected = 0;
+        for(uint32_t v = lo; v <= hi; v++) {
+            expected += oraclep[v];
+        }
+        mu_assert("error, point count", trie_count(triep, lo) == oraclep[lo]);
+        mu_assert("error, range count", trie_count_range(triep, lo, hi) == expected);
+    }
+    free(oraclep);
+
+    TEARDOWN
+}
+
+static char * check_rank_and_quantile(const struct sTrieConfig* configp) {
+    struct sTrie* triep = trie_init_ex(configp);
+    uint64_t* oraclep = calloc(65536, sizeof(*oraclep));
+    uint32_t state = 99;
+    uint64_t total = 0;
+
+    mu_assert("error, empty quantile", trie_quantile(triep, 0.5) == 0);
+    uint16_t values[20000];
+    for(size_t i = 0; i < NELEMS(values); i++) {
+        values[i] = (i % 5 == 0) ? 0 : (i % 2) ? (next_random(&state) & 0x7F) + 1000 : next_random(&state);
+        ++oraclep[values[i]];
+        ++total;
+    }
+    /* Cover both insert paths */
+    for(size_t i = 0; i < NELEMS(values) / 2; i++) {
+        INS(values[i])
+    }
+    trie_insert_values(triep, values + NELEMS(values) / 2, NELEMS(values) - NELEMS(values) / 2);
+
+    uint64_t below = 0;
+    for(uint32_t v = 0; v <= 65535; v += 37) {
+        mu_assert("error, rank", trie_rank(triep, v) == below);
+        for(uint32_t w = v; w < v + 37 && w <= 65535; w++) {
+            below += oraclep[w];
+        }
+    }
+    const double qs[] = {0.0, 0.001, 0.1, 0.2, 0.25, 0.5, 0.9, 0.99, 0.999, 1.0};
+    for(size_t i = 0; i < NELEMS(qs); i++) {
+        uint64_t rank = (uint64_t)(qs[i] * total);
+        if((double)rank < qs[i] * total) {
+            ++rank;
+        }
+        rank = rank == 0 ? 1 : rank;
+        uint32_t expected = 0;
+        for(uint64_t seen = oraclep[0]; seen < rank; seen += oraclep[++expected]);
+        mu_assert("error, quantile", trie_quantile(triep, qs[i]) == expected);
+    }
+    free(oraclep);
+    trie_free(&triep);
+    return 0;
+}
+
+static char * test_rank_and_quantile() {
+    return check_rank_and_quantile(NULL);
+}
+
+static char * test_counted_rank_and_quantile() {
+    const struct sTrieConfig config = { .counted = true };
+    return check_rank_and_quantile(&config);
+}
+
+static char * test_counted_trie_output() {
+    const struct sTrieConfig config = { .counted = true };
+    struct sTrie* triep = trie_init_ex(&config);
+
+    for(int i = 0; i < 40; i++) {
+        INS(1)
+    }
+    INS(0)
+    INS(65535)
+    INS(300)
+
+    EXPECT_TRIE("0 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 300 65535 ");
+    mu_assert("error, counted range", trie_count_range(triep, 1, 300) == 41);
+
+    TEARDOWN
+}
+
+static char * test_reset_reuses_memory() {
+    SETUP
+    uint32_t state = 3;
+    uint16_t values[30000];
+    for(size_t i = 0; i < NELEMS(values); i++) {
+        values[i] = next_random(&state);
+    }
+    trie_insert_values(triep, values, NELEMS(values));
+    size_t reserved = triep->arena.bytes_reserved;
+    mu_assert("error, arena not used", reserved > 0);
+
+    trie_reset(triep);
+    mu_assert("error, reset count", trie_count_range(triep, 0, 65535) == 0);
+    {
+        EXPECT_TRIE("")
+    }
+    trie_insert_values(triep, values, NELEMS(values));
+    mu_assert("error, memory not reused", triep->arena.bytes_reserved == reserved);
+    mu_assert("error, count after reset", trie_count_range(triep, 0, 65535) == NELEMS(values));
+
+    trie_reset(triep);
+    INS(5)
+    INS(0)
+    EXPECT_TRIE("0 5 ")
+
+    TEARDOWN
+}
+
+static char * test_iterator() {
+    SETUP
+
+    TrieIter_t iter;
+    uint16_t value;
+    uint64_t count;
+    trie_iter_init(triep, &iter);
+    mu_assert("error, empty trie", !trie_iter_next(&iter, &value, &count));
+
+    for(int i = 0; i < 1000; i++) {
+        INS(1)
+    }
+    INS(0)
+    INS(3)
+    INS(3)
+    INS(65535)
+
+    const uint16_t expected_values[] = {0, 1, 3, 65535};
+    const uint64_t expected_counts[] = {1, 1000, 2, 1};
+    trie_iter_init(triep, &iter);
+    for(size_t i = 0; i < NELEMS(expected_values); i++) {
+        mu_assert("error, iterator ended early", trie_iter_next(&iter, &value, &count));
+        mu_assert("error, iterator value", value == expected_values[i]);
+        mu_assert("error, iterator count", count == expected_counts[i]);
+    }
+    mu_assert("error, iterator did not end", !trie_iter_next(&iter, &value, &count));
+
+    TEARDOWN
+}
+
+struct visit_oracle {
+    uint64_t* oraclep;
+    uint32_t next_value;
+    uint64_t visited;
+    bool ok;
+};
+
+static bool check_against_oracle(void* ctxp, uint16_t value, uint64_t count) {
+    struct visit_oracle* visitp = ctxp;
+    /* Every value skipped since the last visit must be absent */
+    while(visitp->next_value < value) {
+        visitp->ok &= (visitp->oraclep[visitp->next_value++] == 0);
+    }
+    visitp->ok &= (visitp->oraclep[value] == count && count > 0);
+    visitp->next_value = value + 1;
+    return ++(visitp->visited) < 1000;
+}
+
+static char * test_visit_matches_oracle() {
+    SETUP
+    struct visit_oracle visit = { .oraclep = calloc(65536, sizeof(uint64_t)), .ok = true };
+    uint32_t state = 11;
+    for(int i = 0; i < 100000; i++) {
+        uint16_t value = (i % 2) ? (next_random(&state) & 0xFF) : next_random(&state);
+        INS(value)
+        ++visit.oraclep[value];
+    }
+    /* The visitor stops after 1000 distinct values */
+    mu_assert("error, walk was not stopped", !trie_visit(triep, check_against_oracle, &visit));
+    mu_assert("error, visitor mismatch", visit.ok && visit.visited == 1000);
+    free(visit.oraclep);
+
+    TEARDOWN
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_VALUES_PER_THREAD 50000
+
+struct concurrent_producer {
+    struct sTrie* triep;
+    uint32_t seed;
+};
+
+static uint16_t concurrent_value(uint32_t* statep, int i) {
+    /* Half the values hammer a few data nodes so the threads fight over bursts */
+    return (i % 2) ? (next_random(statep) & 0x3F) : next_random(statep);
+}
+
+static void* concurrent_produce(void* argp) {
+    struct concurrent_producer* producerp = argp;
+    uint32_t state = producerp->seed;
+    for(int i = 0; i < CONCURRENT_VALUES_PER_THREAD; i++) {
+        trie_insert_value_concurrent(producerp->triep, concurrent_value(&state, i));
+    }
+    return NULL;
+}
+
+static char * check_concurrent_insert(bool counted, uint8_t direct_levels) {
+    const struct sTrieConfig config = { .counted = counted, .concurrent = true, .direct_levels = direct_levels };
+    struct sTrie* triep = trie_init_ex(&config);
+    struct sTrie* expected_triep = trie_init_ex(&config);
+    pthread_t threads[CONCURRENT_THREADS];
+    struct concurrent_producer producers[CONCURRENT_THREADS];
+
+    for(int t = 0; t < CONCURRENT_THREADS; t++) {
+        producers[t].triep = triep;
+        producers[t].seed = t + 1;
+        mu_assert("error, thread create", pthread_create(&threads[t], NULL, concurrent_produce, &producers[t]) == 0);
+    }
+    for(int t = 0; t < CONCURRENT_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        uint32_t state = producers[t].seed;
+        for(int i = 0; i < CONCURRENT_VALUES_PER_THREAD; i++) {
+            trie_insert_value(expected_triep, concurrent_value(&state, i));
+        }
+    }
+
+    size_t size, expected_size;
+    char * bytp = trie_to_string(triep, &size);
+    char * expected_bytp = trie_to_string(expected_triep, &expected_size);
+    mu_assert("error, size mismatch", size == expected_size);
+    mu_assert("error, string mismatch", memcmp(bytp, expected_bytp, size) == 0);
+    mu_assert("error, median", trie_quantile(triep, 0.5) == trie_quantile(expected_triep, 0.5));
+    mu_assert("error, rank", trie_rank(triep, 0x8000) == trie_rank(expected_triep, 0x8000));
+    free(bytp);
+    free(expected_bytp);
+    trie_free(&expected_triep);
+    trie_free(&triep);
+    return 0;
+}
+
+static char * test_concurrent_insert() {
+    return check_concurrent_insert(false, 0);
+}
+
+static char * test_concurrent_counted_insert() {
+    return check_concurrent_insert(true, 0);
+}
+
+static char * check_merge(bool dst_counted, bool src_counted) {
+    const struct sTrieConfig dst_config = { .counted = dst_counted };
+    const struct sTrieConfig src_config = { .counted = src_counted };
+    struct sTrie* dst_triep = trie_init_ex(&dst_config);
+    struct sTrie* src_triep = trie_init_ex(&src_config);
+    struct sTrie* expected_triep = trie_init();
+    uint32_t state = 5;
+
+    /* dst is sparse where src is dense and the other way around, so every
+     * combination of node types meets */
+    for(int i = 0; i < 30000; i++) {
+        uint16_t value = next_random(&state);
+        value = (i % 3 == 0) ? (value & 0x7FFF) : (value | 0x8000) & 0x80FF;
+        trie_insert_value(src_triep, value);
+        trie_insert_value(expected_triep, value);
+    }
+    for(int i = 0; i < 30000; i++) {
+        uint16_t value = next_random(&state);
+        value = (i % 3 == 0) ? (value | 0x8000) : value & 0x01FF;
+        trie_insert_value(dst_triep, value);
+        trie_insert_value(expected_triep, value);
+    }
+    trie_merge_into(dst_triep, src_triep);
+
+    size_t size, expected_size;
+    char * bytp = trie_to_string(dst_triep, &size);
+    char * expected_bytp = trie_to_string(expected_triep, &expected_size);
+    mu_assert("error, size mismatch", size == expected_size);
+    mu_assert("error, string mismatch", memcmp(bytp, expected_bytp, size) == 0);
+    for(uint32_t v = 0; v <= 65535; v += 1021) {
+        mu_assert("error, rank after merge", trie_rank(dst_triep, v) == trie_rank(expected_triep, v));
+    }
+    mu_assert("error, src changed", trie_count_range(src_triep, 0, 65535) == 30000);
+    free(bytp);
+    free(expected_bytp);
+    trie_free(&expected_triep);
+    trie_free(&src_triep);
+    trie_free(&dst_triep);
+    return 0;
+}
+
+static char * test_merge() {
+    char * message;
+    if((message = check_merge(false, false)) != NULL) {
+        return message;
+    }
+    if((message = check_merge(true, false)) != NULL) {
+        return message;
+    }
+    if((message = check_merge(false, true)) != NULL) {
+        return message;
+    }
+    return check_merge(true, true);
+}
+
+static char * test_weighted_insert() {
+    SETUP
+
+    trie_insert_value_n(triep, 0, 3);
+    trie_insert_value_n(triep, 9, 2);
+    trie_insert_value_n(triep, 4, 1);
+    trie_insert_value_n(triep, 9, 0);
+    trie_insert_value_n(triep, 65535, 2);
+    EXPECT_TRIE("0 0 0 4 9 9 65535 65535 ")
+
+    /* Large weights go straight down to the count nodes */
+    trie_insert_value_n(triep, 9, 5000000000ULL);
+    mu_assert("error, large weight", trie_count(triep, 9) == 5000000002ULL);
+    mu_assert("error, neighbours", trie_count(triep, 4) == 1 && trie_count(triep, 65535) == 2);
+
+    TEARDOWN
+}
+
+static char * check_weighted_insert_matches_single_inserts(const struct sTrieConfig* configp) {
+    struct sTrie* triep = trie_init_ex(configp);
+    struct sTrie* single_triep = trie_init();
+    uint32_t state = 17;
+    for(int i = 0; i < 5000; i++) {
+        uint16_t value = (i % 2) ? (next_random(&state) & 0x3FF) : next_random(&state);
+        uint8_t n = next_random(&state) % 40;
+        trie_insert_value_n(triep, value, n);
+        for(uint8_t j = 0; j < n; j++) {
+            trie_insert_value(single_triep, value);
+        }
+    }
+    size_t size, single_size;
+    char * bytp = trie_to_string(triep, &size);
+    char * single_bytp = trie_to_string(single_triep, &single_size);
+    mu_assert("error, size mismatch", size == single_size);
+    mu_assert("error, string mismatch", memcmp(bytp, single_bytp, size) == 0);
+    for(uint32_t v = 0; v <= 65535; v += 509) {
+        mu_assert("error, weighted rank", trie_rank(triep, v) == trie_rank(single_triep, v));
+    }
+    free(bytp);
+    free(single_bytp);
+    trie_free(&single_triep);
+    trie_free(&triep);
+    return 0;
+}
+
+static char * test_weighted_insert_matches_single_inserts() {
+    const struct sTrieConfig config = { .counted = true };
+    char * message = check_weighted_insert_matches_single_inserts(NULL);
+    return message ? message : check_weighted_insert_matches_single_inserts(&config);
+}
+
+/* Value i of the mix make_mixed_trie inserts: zeros, a few heavy hitters, small values
+ * and anything at all */
+static uint16_t next_mixed_value(uint32_t* statep, int i) {
+    uint16_t value = next_random(statep);
+    return (i % 4 == 0) ? 0 : (i % 4 == 1) ? (value & 0x7) + 300 : (i % 4 == 2) ? value & 0xFFF : value;
+}
+
+static struct sTrie* make_mixed_trie(const struct sTrieConfig* configp, uint32_t seed, int n) {
+    struct sTrie* triep = trie_init_ex(configp);
+    uint32_t state = seed;
+    for(int i = 0; i < n; i++) {
+        trie_insert_value(triep, next_mixed_value(&state, i));
+    }
+    return triep;
+}
+
+static char * check_same_values(struct sTrie* triep, struct sTrie* expected_triep) {
+    size_t size, expected_size;
+    char * bytp = trie_to_string(triep, &size);
+    char * expected_bytp = trie_to_string(expected_triep, &expected_size);
+    bool same = (size == expected_size) && memcmp(bytp, expected_bytp, size) == 0;
+    free(bytp);
+    free(expected_bytp);
+    mu_assert("error, tries differ", same);
+    return 0;
+}
+
+static char * test_interleaved_batch_insert() {
+    const struct sTrieConfig configs[] = {
+        { .interleaved = true },
+        { .interleaved = true, .counted = true },
+        { .interleaved = true, .vertical = true },
+    };
+    struct sTrie* single_triep = trie_init();
+    uint32_t state = 43;
+    const size_t n = 100000;
+    uint16_t* values = malloc(n * sizeof(*values));
+    for(size_t i = 0; i < n; i++) {
+        /* Runs of one value keep several cursors on the same node while it bursts */
+        values[i] = (i % 3 == 0) ? (next_random(&state) & 0x3F) : (i % 3 == 1) ? 777 : next_random(&state);
+        trie_insert_value(single_triep, values[i]);
+    }
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        struct sTrie* triep = trie_init_ex(&configs[c]);
+        trie_insert_values(triep, values, 5);
+        trie_insert_values(triep, values + 5, n - 5);
+        char * message = check_same_values(triep, single_triep);
+        if(message) {
+            return message;
+        }
+        mu_assert("error, interleaved rank", trie_rank(triep, 0x4000) == trie_rank(single_triep, 0x4000));
+        mu_assert("error, interleaved median", trie_quantile(triep, 0.5) == trie_quantile(single_triep, 0.5));
+        trie_free(&triep);
+    }
+    free(values);
+    trie_free(&single_triep);
+    return 0;
+}
+
+static char * test_serialize_round_trip() {
+    const struct sTrieConfig counted_config = { .counted = true };
+    struct sTrie* triep = make_mixed_trie(NULL, 23, 40000);
+    char * bytp;
+    size_t size;
+    FILE* fp = open_memstream(&bytp, &size);
+    mu_assert("error, serialize", trie_serialize(triep, fp) == 0);
+    fclose(fp);
+    /* Much smaller than the text dump */
+    mu_assert("error, encoding too large", size < 40000);
+
+    for(int counted = 0; counted < 2; counted++) {
+        fp = fmemopen(bytp, size, "r");
+        struct sTrie* copyp = trie_deserialize(fp, counted ? &counted_config : NULL);
+        fclose(fp);
+        mu_assert("error, deserialize", copyp != NULL);
+        char * message = check_same_values(copyp, triep);
+        if(message) {
+            return message;
+        }
+        mu_assert("error, deserialized rank", trie_rank(copyp, 5000) == trie_rank(triep, 5000));
+        /* The copy keeps working as a normal trie */
+        trie_insert_value(copyp, 303);
+        mu_assert("error, insert after deserialize", trie_count(copyp, 303) == trie_count(triep, 303) + 1);
+        trie_free(&copyp);
+    }
+
+    /* Truncated and corrupted streams are rejected */
+    fp = fmemopen(bytp, size / 2, "r");
+    mu_assert("error, truncated stream", trie_deserialize(fp, NULL) == NULL);
+    fclose(fp);
+    /* A config trie_init_ex rejects is turned down, with or without direct levels */
+    const struct sTrieConfig rejected_configs[] = {
+        { .concurrent = true, .compact_counts = true },
+        { .concurrent = true, .hot_values = true, .direct_levels = 2 },
+    };
+    for(size_t c = 0; c < NELEMS(rejected_configs); c++) {
+        fp = fmemopen(bytp, size, "r");
+        mu_assert("error, rejected config", trie_deserialize(fp, &rejected_configs[c]) == NULL);
+        fclose(fp);
+    }
+    bytp[0] = 'X';
+    fp = fmemopen(bytp, size, "r");
+    mu_assert("error, bad magic", trie_deserialize(fp, NULL) == NULL);
+    fclose(fp);
+    free(bytp);
+    trie_free(&triep);
+    return 0;
+}
+
+static char * test_image_mmap() {
+    struct sTrie* triep = make_mixed_trie(NULL, 29, 40000);
+    TrieImage_t image;
+    FILE* fp = tmpfile();
+    mu_assert("error, image write", trie_image_write(triep, fp) == 0);
+    fflush(fp);
+    size_t size = ftell(fp);
+    void* mapp = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    mu_assert("error, mmap", mapp != MAP_FAILED);
+    mu_assert("error, image open", trie_image_open(&image, mapp, size));
+    mu_assert("error, short image", !trie_image_open(&image, mapp, size - 64));
+    mu_assert("error, image open", trie_image_open(&image, mapp, size));
+
+    uint32_t state = 31;
+    for(int i = 0; i < 500; i++) {
+        uint16_t lo = next_random(&state);
+        uint16_t hi = lo + (next_random(&state) & 0xFFF);
+        mu_assert("error, image count", trie_image_count(&image, lo) == trie_count(triep, lo));
+        mu_assert("error, image range", trie_image_count_range(&image, lo, hi) == trie_count_range(triep, lo, hi));
+        mu_assert("error, image rank", trie_image_rank(&image, lo) == trie_rank(triep, lo));
+    }
+    mu_assert("error, image zeros", trie_image_count(&image, 0) == trie_count(triep, 0));
+    mu_assert("error, image median", trie_image_quantile(&image, 0.5) == trie_quantile(triep, 0.5));
+    mu_assert("error, image p99", trie_image_quantile(&image, 0.99) == trie_quantile(triep, 0.99));
+
+    munmap(mapp, size);
+    fclose(fp);
+    trie_free(&triep);
+    return 0;
+}
+
+static char * test_stats() {
+    SETUP
+    TrieStats_t stats;
+    trie_get_stats(triep, &stats);
+    mu_assert("error, empty trie nodes", stats.data_nodes == 1 && stats.travel_nodes == 0 && stats.count_nodes == 0);
+    mu_assert("error, empty fill factor", stats.data_fill_factor == 0);
+
+    /* Spread over every top level subnode, so the base node bursts once */
+    for(uint16_t i = 1; i <= 32; i++) {
+        INS(i * 2000);
+    }
+    trie_get_stats(triep, &stats);
+    mu_assert("error, single burst nodes", stats.data_nodes == 8 && stats.travel_nodes == 1 && stats.count_nodes == 0);
+    mu_assert("error, single burst bytes", stats.bytes_used == 9 * sizeof(Node_t));
+    mu_assert("error, single burst fill", stats.data_fill_factor == 32.0 / (8 * 32));
+    if(stats.counters_enabled) {
+        mu_assert("error, single burst counters", stats.counters.bursts[0] == 1 && stats.counters.cascading_bursts == 0);
+        mu_assert("error, single burst descents", stats.counters.descents == 32);
+    }
+    trie_reset(triep);
+
+    /* The same value bursts all the way down to the count nodes */
+    for(int i = 0; i < 33; i++) {
+        INS(4242);
+    }
+    trie_get_stats(triep, &stats);
+    mu_assert("error, cascade nodes", stats.data_nodes == 28 && stats.travel_nodes == 5 && stats.count_nodes == 8);
+    /* The base node, four slabs of data nodes and one of packed count nodes */
+    mu_assert("error, cascade bytes", stats.bytes_used == (1 + 4 * 8) * sizeof(Node_t) + 8 * 2 * sizeof(uint64_t));
+    if(stats.counters_enabled) {
+        mu_assert("error, cascade bursts", stats.counters.cascading_bursts == 4);
+        for(int depth = 0; depth < 5; depth++) {
+            mu_assert("error, cascade bursts per depth", stats.counters.bursts[depth] == 1);
+        }
+        mu_assert("error, cascade depth", stats.counters.descents == 33 &&
+                                           stats.average_descent_depth == 5.0 / 33);
+    }
+    trie_reset(triep);
+
+    /* Every value often enough that no data node is left */
+    for(int r = 0; r < 3; r++) {
+        for(uint32_t v = 0; v <= 0xFFFF; v++) {
+            INS(v);
+        }
+    }
+    trie_get_stats(triep, &stats);
+    mu_assert("error, saturated nodes", stats.data_nodes == 0 && stats.count_nodes > 0);
+    mu_assert("error, saturated fill factor", stats.data_fill_factor == 0);
+    TEARDOWN
+}
+
+static bool in_arena(const struct sTrieArena* arenap, const void* p) {
+    for(const struct sTrieArenaChunk* chunkp = arenap->chunks; chunkp != NULL; chunkp = chunkp->next) {
+        if((const uint8_t*)p >= (const uint8_t*)chunkp && (const uint8_t*)p < (const uint8_t*)chunkp + chunkp->size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static char * test_vertical_layout() {
+    const struct sTrieConfig configs[] = {
+        { .vertical = true },
+        { .vertical = true, .counted = true },
+    };
+    struct sTrie* plain_triep = make_mixed_trie(NULL, 37, 60000);
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        struct sTrie* triep = make_mixed_trie(&configs[c], 37, 60000);
+        char * message = check_same_values(triep, plain_triep);
+        if(message) {
+            return message;
+        }
+        mu_assert("error, vertical rank", trie_rank(triep, 4000) == trie_rank(plain_triep, 4000));
+
+        /* Everything below a top level subtrie comes out of its lane */
+        for(uint8_t i = 0; i < TRIE_ARENA_LANES; i++) {
+            Node_t* subtriep = (Node_t*)((uintptr_t)triep->base_node->travel.link[i] & ~(uintptr_t)1);
+            if(subtriep->data.data[0] != 0) {
+                mu_assert("error, slab outside its lane", in_arena(&triep->lanes[i], subtriep->travel.link[0]));
+            }
+        }
+        TrieStats_t stats;
+        trie_get_stats(triep, &stats);
+        mu_assert("error, lanes not in the stats", stats.bytes_used > triep->arena.bytes_used);
+
+        /* Merging goes through the lanes too */
+        trie_merge_into(triep, plain_triep);
+        mu_assert("error, vertical merge", trie_count(triep, 301) == 2 * trie_count(plain_triep, 301));
+        trie_reset(triep);
+        trie_get_stats(triep, &stats);
+        mu_assert("error, vertical reset", stats.bytes_used == sizeof(Node_t));
+        trie_free(&triep);
+    }
+    trie_free(&plain_triep);
+    return 0;
+}
+
+static char * test_direct_levels() {
+    const struct sTrieConfig too_deep = { .direct_levels = TRIE_DIRECT_LEVELS_MAX + 1 };
+    mu_assert("error, direct levels too deep", trie_init_ex(&too_deep) == NULL);
+
+    struct sTrie* plain_triep = make_mixed_trie(NULL, 41, 60000);
+    char * bytp;
+    size_t size;
+    FILE* fp = open_memstream(&bytp, &size);
+    mu_assert("error, serialize", trie_serialize(plain_triep, fp) == 0);
+    fclose(fp);
+    for(uint8_t levels = 1; levels <= TRIE_DIRECT_LEVELS_MAX; levels++) {
+        for(int counted = 0; counted < 2; counted++) {
+            const struct sTrieConfig config = { .direct_levels = levels, .counted = counted };
+            struct sTrie* triep = trie_init_ex(&config);
+            TrieStats_t stats;
+            trie_get_stats(triep, &stats);
+            mu_assert("error, direct levels not burst", stats.data_nodes == (1u << (3 * levels)));
+            trie_free(&triep);
+
+            triep = make_mixed_trie(&config, 41, 60000);
+            char * message = check_same_values(triep, plain_triep);
+            if(message) {
+                return message;
+            }
+            mu_assert("error, direct rank", trie_rank(triep, 0x2345) == trie_rank(plain_triep, 0x2345));
+            mu_assert("error, direct p90", trie_quantile(triep, 0.9) == trie_quantile(plain_triep, 0.9));
+            trie_insert_value_n(triep, 0x2345, 100);
+            mu_assert("error, direct weighted", trie_count(triep, 0x2345) == trie_count(plain_triep, 0x2345) + 100);
+            mu_assert("error, direct weighted rank", trie_rank(triep, 0x2346) == trie_rank(plain_triep, 0x2346) + 100);
+
+            /* Resetting rebuilds the top levels */
+            trie_reset(triep);
+            trie_insert_value(triep, 0x2345);
+            mu_assert("error, direct reset", trie_count_range(triep, 0, 0xFFFF) == 1 && trie_rank(triep, 0x2346) == 1);
+            trie_free(&triep);
+
+            fp = fmemopen(bytp, size, "r");
+            triep = trie_deserialize(fp, &config);
+            fclose(fp);
+            mu_assert("error, direct deserialize", triep != NULL);
+            message = check_same_values(triep, plain_triep);
+            if(message) {
+                return message;
+            }
+            trie_insert_value(triep, 0x2345);
+            mu_assert("error, direct insert after deserialize", trie_count(triep, 0x2345) == trie_count(plain_triep, 0x2345) + 1);
+            trie_free(&triep);
+        }
+    }
+    free(bytp);
+    trie_free(&plain_triep);
+    return check_concurrent_insert(true, 2);
+}
+
+static char * test_compact_counts() {
+    const struct sTrieConfig configs[] = {
+        { .compact_counts = true },
+        { .compact_counts = true, .counted = true },
+    };
+    const struct sTrieConfig concurrent_config = { .compact_counts = true, .concurrent = true };
+    mu_assert("error, compact concurrent", trie_init_ex(&concurrent_config) == NULL);
+
+    struct sTrie* plain_triep = make_mixed_trie(NULL, 47, 60000);
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        struct sTrie* triep = make_mixed_trie(&configs[c], 47, 60000);
+        char * message = check_same_values(triep, plain_triep);
+        if(message) {
+            return message;
+        }
+        mu_assert("error, compact rank", trie_rank(triep, 0x1234) == trie_rank(plain_triep, 0x1234));
+        mu_assert("error, compact median", trie_quantile(triep, 0.5) == trie_quantile(plain_triep, 0.5));
+        TrieStats_t stats, plain_stats;
+        trie_get_stats(triep, &stats);
+        trie_get_stats(plain_triep, &plain_stats);
+        mu_assert("error, no packed nodes", stats.packed_nodes > 0 && stats.bytes_used < plain_stats.bytes_used);
+
+        /* Merging either way matches the plain trie */
+        struct sTrie* merged_triep = trie_init();
+        trie_merge_into(merged_triep, triep);
+        message = check_same_values(merged_triep, plain_triep);
+        if(message) {
+            return message;
+        }
+        trie_free(&merged_triep);
+        merged_triep = trie_init_ex(&configs[c]);
+        trie_merge_into(merged_triep, plain_triep);
+        trie_merge_into(merged_triep, triep);
+        mu_assert("error, compact merge", trie_count(merged_triep, 301) == 2 * trie_count(plain_triep, 301));
+        mu_assert("error, compact merge rank", trie_rank(merged_triep, 0x1234) == 2 * trie_rank(plain_triep, 0x1234));
+        trie_free(&merged_triep);
+        trie_reset(triep);
+
+        /* A packed node is promoted once one of its counters would overflow */
+        for(int i = 0; i < 33; i++) {
+            trie_insert_value(triep, 4242);
+        }
+        trie_get_stats(triep, &stats);
+        mu_assert("error, cascade packed", stats.packed_nodes == 1 && stats.count_nodes == 0);
+        mu_assert("error, cascade packed bytes", stats.bytes_used == (1 + 4 * (8 + configs[c].counted)) * sizeof(Node_t));
+        trie_insert_value_n(triep, 4242, 0xFFFF - 33);
+        trie_insert_value(triep, 4243);
+        trie_get_stats(triep, &stats);
+        mu_assert("error, promoted too early", stats.packed_nodes == 1);
+        trie_insert_value(triep, 4242);
+        trie_get_stats(triep, &stats);
+        mu_assert("error, not promoted", stats.packed_nodes == 0 && stats.count_nodes == 8);
+        if(stats.counters_enabled) {
+            mu_assert("error, promotions", stats.counters.promotions == 1);
+        }
+        mu_assert("error, promoted count", trie_count(triep, 4242) == 0xFFFF + 1 && trie_count(triep, 4243) == 1);
+        mu_assert("error, promoted rank", trie_rank(triep, 4243) == 0xFFFF + 1);
+        trie_insert_value_n(triep, 4250, 70000);
+        mu_assert("error, weighted promotion", trie_count(triep, 4250) == 70000 && trie_count_range(triep, 4240, 4250) == 70000 + 0xFFFF + 2);
+
+        /* Large counters survive a round trip into a compact trie */
+        char * bytp;
+        size_t size;
+        FILE* fp = open_memstream(&bytp, &size);
+        mu_assert("error, serialize", trie_serialize(triep, fp) == 0);
+        fclose(fp);
+        fp = fmemopen(bytp, size, "r");
+        struct sTrie* copyp = trie_deserialize(fp, &configs[c]);
+        fclose(fp);
+        free(bytp);
+        mu_assert("error, deserialize", copyp != NULL);
+        message = check_same_values(copyp, triep);
+        if(message) {
+            return message;
+        }
+        trie_free(&copyp);
+        trie_free(&triep);
+    }
+
+    /* Images expand the packed nodes */
+    struct sTrie* triep = make_mixed_trie(&configs[0], 47, 60000);
+    TrieImage_t image;
+    size_t size;
+    void* bytp = image_to_buffer(triep, &size);
+    mu_assert("error, image write", bytp != NULL);
+    mu_assert("error, image open", trie_image_open(&image, bytp, size));
+    for(uint32_t v = 1; v <= 0xFFFF; v += 97) {
+        mu_assert("error, compact image count", trie_image_count(&image, v) == trie_count(triep, v));
+        mu_assert("error, compact image rank", trie_image_rank(&image, v) == trie_rank(triep, v));
+    }
+    mu_assert("error, compact image median", trie_image_quantile(&image, 0.5) == trie_quantile(triep, 0.5));
+    free(bytp);
+    trie_free(&triep);
+    trie_free(&plain_triep);
+    return 0;
+}
+
+static char * test_compact_links() {
+    const struct sTrieConfig configs[] = {
+        { .compact_links = true },
+        { .compact_links = true, .counted = true },
+        { .compact_links = true, .counted = true, .vertical = true },
+        { .compact_links = true, .counted = true, .direct_levels = 2 },
+        { .compact_links = true, .counted = true, .compact_counts = true },
+    };
+    const struct sTrieConfig concurrent_config = { .compact_links = true, .concurrent = true };
+    mu_assert("error, compact links concurrent", trie_init_ex(&concurrent_config) == NULL);
+
+    const struct sTrieConfig counted_config = { .counted = true };
+    struct sTrie* plain_triep = make_mixed_trie(NULL, 53, 60000);
+    struct sTrie* counted_triep = make_mixed_trie(&counted_config, 53, 60000);
+    TrieStats_t counted_stats;
+    trie_get_stats(counted_triep, &counted_stats);
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        struct sTrie* triep = make_mixed_trie(&configs[c], 53, 60000);
+        char * message = check_same_values(triep, plain_triep);
+        if(message) {
+            return message;
+        }
+        for(uint32_t v = 1; v <= 0xFFFF; v += 211) {
+            mu_assert("error, compact links rank", trie_rank(triep, v) == trie_rank(plain_triep, v));
+            mu_assert("error, compact links range", trie_count_range(triep, v / 2, v) == trie_count_range(plain_triep, v / 2, v));
+        }
+        mu_assert("error, compact links median", trie_quantile(triep, 0.5) == trie_quantile(plain_triep, 0.5));
+        /* The link totals live in the travel nodes instead of a line per slab */
+        TrieStats_t stats;
+        trie_get_stats(triep, &stats);
+        mu_assert("error, compact links totals", stats.total_nodes == 0);
+        if(configs[c].counted && !configs[c].compact_counts) {
+            mu_assert("error, compact links bytes", stats.bytes_used < counted_stats.bytes_used);
+        }
+
+        /* Merging either way matches the plain trie */
+        struct sTrie* merged_triep = trie_init();
+        trie_merge_into(merged_triep, triep);
+        message = check_same_values(merged_triep, plain_triep);
+        if(message) {
+            return message;
+        }
+        trie_free(&merged_triep);
+        merged_triep = trie_init_ex(&configs[c]);
+        trie_merge_into(merged_triep, plain_triep);
+        trie_merge_into(merged_triep, triep);
+        mu_assert("error, compact links merge", trie_count(merged_triep, 301) == 2 * trie_count(plain_triep, 301));
+        mu_assert("error, compact links merge rank", trie_rank(merged_triep, 0x1234) == 2 * trie_rank(plain_triep, 0x1234));
+        trie_free(&merged_triep);
+
+        /* Round trip through a stream */
+        char * bytp;
+        size_t size;
+        FILE* fp = open_memstream(&bytp, &size);
+        mu_assert("error, serialize", trie_serialize(triep, fp) == 0);
+        fclose(fp);
+        fp = fmemopen(bytp, size, "r");
+        struct sTrie* copyp = trie_deserialize(fp, &configs[c]);
+        fclose(fp);
+        free(bytp);
+        mu_assert("error, deserialize", copyp != NULL);
+        message = check_same_values(copyp, plain_triep);
+        if(message) {
+            return message;
+        }
+        trie_free(&copyp);
+
+        /* Images hold plain links whatever the trie they were written from */
+        TrieImage_t image;
+        void* imagep = image_to_buffer(triep, &size);
+        mu_assert("error, image write", imagep != NULL);
+        mu_assert("error, image open", trie_image_open(&image, imagep, size));
+        for(uint32_t v = 1; v <= 0xFFFF; v += 97) {
+            mu_assert("error, compact links image rank", trie_image_rank(&image, v) == trie_rank(plain_triep, v));
+        }
+        free(imagep);
+
+        /* Totals far past 32 bits */
+        trie_reset(triep);
+        trie_insert_value_n(triep, 4242, 1ULL << 40);
+        trie_insert_value(triep, 4243);
+        trie_insert_value_n(triep, 60000, 3);
+        mu_assert("error, compact links large count", trie_count(triep, 4242) == 1ULL << 40);
+        mu_assert("error, compact links large rank", trie_rank(triep, 4243) == 1ULL << 40);
+        mu_assert("error, compact links large range", trie_count_range(triep, 1, 0xFFFF) == (1ULL << 40) + 4);
+        trie_free(&triep);
+    }
+    trie_free(&counted_triep);
+    trie_free(&plain_triep);
+    return 0;
+}
+
+static char * test_print_values_parallel() {
+    const struct sTrieConfig configs[] = {
+        { 0 },
+        { .counted = true, .compact_links = true },
+        { .compact_counts = true, .direct_levels = 2 },
+    };
+    const int sizes[] = { 0, 20, 5000, 200000 };
+    const unsigned threads[] = { 1, 3, 0 };
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        for(size_t s = 0; s < NELEMS(sizes); s++) {
+            struct sTrie* triep = make_mixed_trie(&configs[c], 71, sizes[s]);
+            size_t expected_size;
+            char * expected_bytp = trie_to_string(triep, &expected_size);
+            for(size_t t = 0; t < NELEMS(threads); t++) {
+                char * bytp;
+                size_t size;
+                FILE* fp = open_memstream(&bytp, &size);
+                mu_assert("error, parallel print", trie_print_values_parallel(triep, fp, threads[t]) == 0);
+                fclose(fp);
+                bool same = (size == expected_size) && memcmp(bytp, expected_bytp, size) == 0;
+                free(bytp);
+                mu_assert("error, parallel print differs", same);
+            }
+            free(expected_bytp);
+            trie_free(&triep);
+        }
+    }
+    return 0;
+}
+
+static char * test_print_values_format() {
+    /* Every value once, and runs long enough to fill the print buffer several times */
+    struct sTrie* triep = trie_init();
+    for(uint32_t v = 0; v <= 0xFFFF; v++) {
+        trie_insert_value(triep, v);
+    }
+    trie_insert_value_n(triep, 0, 30000);
+    trie_insert_value_n(triep, 7, 12345);
+    trie_insert_value_n(triep, 54321, 70001);
+    char* expected_bytp;
+    size_t expected_size;
+    FILE* fp = open_memstream(&expected_bytp, &expected_size);
+    TrieIter_t iter;
+    trie_iter_init(triep, &iter);
+    uint16_t value;
+    uint64_t count;
+    while(trie_iter_next(&iter, &value, &count)) {
+        for(; count > 0; count--) {
+            fprintf(fp, "%u ", value);
+        }
+    }
+    fclose(fp);
+    size_t size;
+    char* bytp = trie_to_string(triep, &size);
+    mu_assert("error, print size", size == expected_size);
+    mu_assert("error, print text", memcmp(bytp, expected_bytp, size) == 0);
+    free(bytp);
+    fp = open_memstream(&bytp, &size);
+    mu_assert("error, parallel print", trie_print_values_parallel(triep, fp, 4) == 0);
+    fclose(fp);
+    mu_assert("error, parallel print size", size == expected_size);
+    mu_assert("error, parallel print text", memcmp(bytp, expected_bytp, size) == 0);
+    free(bytp);
+    free(expected_bytp);
+    trie_free(&triep);
+    return 0;
+}
+
+static char * test_free_async() {
+    struct sTrie* tries[16];
+    for(size_t i = 0; i < NELEMS(tries); i++) {
+        tries[i] = make_mixed_trie(NULL, 73 + i, 20000);
+    }
+    for(size_t i = 0; i < NELEMS(tries); i++) {
+        trie_free_async(&tries[i]);
+        mu_assert("error, free async", tries[i] == NULL);
+    }
+    trie_free_async_wait();
+    /* The reclaimer is still around for later tries */
+    struct sTrieWindow* windowp = trie_window_init(2, NULL);
+    struct sTrie* triep = make_mixed_trie(NULL, 79, 20000);
+    trie_free_async(&triep);
+    trie_window_free(&windowp);
+    trie_free_async_wait();
+    return 0;
+}
+
+typedef struct {
+    struct sTrie* trie;
+    struct sTrie* expected;
+    bool same;
+} HotReader_t;
+
+static void* hot_read(void* argp) {
+    HotReader_t* readerp = argp;
+    readerp->same = true;
+    for(uint32_t v = 0; v <= 0xFFFF; v += 37) {
+        readerp->same &= (trie_count(readerp->trie, v) == trie_count(readerp->expected, v));
+        readerp->same &= (trie_rank(readerp->trie, v) == trie_rank(readerp->expected, v));
+    }
+    return NULL;
+}
+
+static char * test_hot_values() {
+    const struct sTrieConfig configs[] = {
+        { .hot_values = true },
+        { .hot_values = true, .counted = true },
+        { .hot_values = true, .counted = true, .compact_counts = true, .direct_levels = 1 },
+    };
+    const struct sTrieConfig concurrent_config = { .hot_values = true, .concurrent = true };
+    mu_assert("error, hot concurrent", trie_init_ex(&concurrent_config) == NULL);
+
+    /* Mostly a few values, with the odd one from anywhere */
+    static uint16_t values[200000];
+    uint32_t state = 83;
+    for(size_t i = 0; i < NELEMS(values); i++) {
+        uint16_t value = next_random(&state);
+        values[i] = (value % 10 != 0) ? 1000 + (value % 7) * 3 : value;
+    }
+    struct sTrie* plain_triep = trie_init();
+    trie_insert_values(plain_triep, values, NELEMS(values));
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        struct sTrie* triep = trie_init_ex(&configs[c]);
+        for(size_t i = 0; i < NELEMS(values) / 2; i++) {
+            trie_insert_value(triep, values[i]);
+        }
+        /* Queries in between see everything inserted so far */
+        mu_assert("error, hot count half", trie_count(triep, 1000) == trie_count_range(triep, 1000, 1000));
+        trie_insert_values(triep, &values[NELEMS(values) / 2], NELEMS(values) - NELEMS(values) / 2);
+        /* Once flushed, several readers can query at once */
+        trie_flush(triep);
+        for(size_t i = 0; i < TRIE_HOT_VALUES; i++) {
+            mu_assert("error, hot flush", triep->hot.pending[i] == 0);
+        }
+        HotReader_t readers[2] = { { .trie = triep, .expected = plain_triep }, { .trie = triep, .expected = plain_triep } };
+        pthread_t threads[NELEMS(readers)];
+        for(size_t r = 0; r < NELEMS(readers); r++) {
+            pthread_create(&threads[r], NULL, hot_read, &readers[r]);
+        }
+        for(size_t r = 0; r < NELEMS(readers); r++) {
+            pthread_join(threads[r], NULL);
+            mu_assert("error, hot readers", readers[r].same);
+        }
+        char * message = check_same_values(triep, plain_triep);
+        if(message) {
+            return message;
+        }
+        for(uint32_t v = 0; v <= 0xFFFF; v += 101) {
+            mu_assert("error, hot rank", trie_rank(triep, v) == trie_rank(plain_triep, v));
+        }
+        mu_assert("error, hot count", trie_count(triep, 1003) == trie_count(plain_triep, 1003));
+        mu_assert("error, hot median", trie_quantile(triep, 0.5) == trie_quantile(plain_triep, 0.5));
+        TrieStats_t stats;
+        trie_get_stats(triep, &stats);
+        if(stats.counters_enabled) {
+            mu_assert("error, hot hits", stats.counters.hot_hits > NELEMS(values) / 2);
+        }
+
+        /* Pending counts that outgrow 16 bits, and a copy through a stream */
+        for(int i = 0; i < 200000; i++) {
+            trie_insert_value(triep, 1006);
+        }
+        mu_assert("error, hot overflow", trie_count(triep, 1006) == trie_count(plain_triep, 1006) + 200000);
+        char * bytp;
+        size_t size;
+        FILE* fp = open_memstream(&bytp, &size);
+        mu_assert("error, serialize", trie_serialize(triep, fp) == 0);
+        fclose(fp);
+        fp = fmemopen(bytp, size, "r");
+        struct sTrie* copyp = trie_deserialize(fp, NULL);
+        fclose(fp);
+        free(bytp);
+        mu_assert("error, hot deserialize", copyp != NULL && trie_count(copyp, 1006) == trie_count(triep, 1006));
+        trie_free(&copyp);
+
+        /* Merging out of a hot trie takes the pending counts along */
+        struct sTrie* merged_triep = trie_init();
+        trie_insert_value(triep, 1009);
+        trie_merge_into(merged_triep, triep);
+        mu_assert("error, hot merge", trie_count(merged_triep, 1009) == trie_count(plain_triep, 1009) + 1);
+        trie_free(&merged_triep);
+
+        trie_reset(triep);
+        mu_assert("error, hot reset", trie_count_range(triep, 0, 0xFFFF) == 0);
+        trie_insert_value(triep, 1000);
+        mu_assert("error, hot after reset", trie_count(triep, 1000) == 1);
+        trie_free(&triep);
+    }
+    trie_free(&plain_triep);
+    return 0;
+}
+
+static char * test_remove() {
+    const struct sTrieConfig configs[] = {
+        { 0 },
+        { .counted = true },
+        { .counted = true, .vertical = true },
+        { .counted = true, .direct_levels = 2 },
+        { .counted = true, .compact_counts = true },
+        { .counted = true, .compact_links = true },
+    };
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        /* Take every other value back out */
+        struct sTrie* triep = make_mixed_trie(&configs[c], 67, 60000);
+        struct sTrie* expected_triep = trie_init();
+        uint32_t state = 67;
+        for(int i = 0; i < 60000; i++) {
+            uint16_t value = next_mixed_value(&state, i);
+            if(i % 2 == 0) {
+                mu_assert("error, remove", trie_remove_value(triep, value));
+            } else {
+                trie_insert_value(expected_triep, value);
+            }
+        }
+        char * message = check_same_values(triep, expected_triep);
+        if(message) {
+            return message;
+        }
+        for(uint32_t v = 1; v <= 0xFFFF; v += 97) {
+            mu_assert("error, remove rank", trie_rank(triep, v) == trie_rank(expected_triep, v));
+        }
+        mu_assert("error, remove median", trie_quantile(triep, 0.5) == trie_quantile(expected_triep, 0.5));
+        for(uint32_t v = 0xFFF0; v <= 0xFFFF; v++) {
+            if(trie_count(expected_triep, v) == 0) {
+                mu_assert("error, remove missing", !trie_remove_value(triep, v));
+            }
+        }
+
+        /* Weighted removal stops at what is there */
+        uint64_t heavy = trie_count(triep, 301);
+        mu_assert("error, remove n", trie_remove_value_n(triep, 301, heavy - 1) == heavy - 1 && trie_count(triep, 301) == 1);
+        mu_assert("error, remove n past count", trie_remove_value_n(triep, 301, 100) == 1 && trie_count(triep, 301) == 0);
+        trie_insert_value_n(triep, 301, heavy);
+
+        /* Emptying the trie collapses it and puts the slabs up for reuse */
+        TrieStats_t stats;
+        trie_get_stats(triep, &stats);
+        size_t reserved = stats.bytes_reserved;
+        size_t used = stats.bytes_used;
+        state = 67;
+        for(int i = 0; i < 60000; i++) {
+            uint16_t value = next_mixed_value(&state, i);
+            if(i % 2 == 1) {
+                mu_assert("error, remove rest", trie_remove_value(triep, value));
+            }
+        }
+        mu_assert("error, not empty", trie_count_range(triep, 0, 0xFFFF) == 0 && trie_quantile(triep, 0.5) == 0);
+        trie_get_stats(triep, &stats);
+        if(configs[c].direct_levels == 0) {
+            mu_assert("error, not collapsed", stats.travel_nodes == 0 && stats.bytes_used == sizeof(Node_t));
+        }
+        if(stats.counters_enabled) {
+            mu_assert("error, collapses", stats.counters.collapses > 0);
+        }
+        state = 67;
+        for(int i = 0; i < 60000; i++) {
+            uint16_t value = next_mixed_value(&state, i);
+            if(i % 2 == 1) {
+                trie_insert_value(triep, value);
+            }
+        }
+        message = check_same_values(triep, expected_triep);
+        if(message) {
+            return message;
+        }
+        trie_get_stats(triep, &stats);
+        mu_assert("error, slabs not reused", stats.bytes_reserved == reserved && stats.bytes_used == used);
+
+        /* Subtracting a prefix of the inserts leaves the rest */
+        struct sTrie* src_triep = make_mixed_trie(NULL, 67, 20000);
+        trie_free(&expected_triep);
+        expected_triep = trie_init();
+        state = 67;
+        for(int i = 0; i < 60000; i++) {
+            uint16_t value = next_mixed_value(&state, i);
+            if(i % 2 == 1 && i >= 20000) {
+                trie_insert_value(expected_triep, value);
+            }
+        }
+        trie_reset(triep);
+        trie_merge_into(triep, expected_triep);
+        trie_merge_into(triep, src_triep);
+        trie_subtract(triep, src_triep);
+        message = check_same_values(triep, expected_triep);
+        if(message) {
+            return message;
+        }
+        mu_assert("error, subtract rank", trie_rank(triep, 0x1234) == trie_rank(expected_triep, 0x1234));
+        /* Taking away more than there is empties the trie */
+        trie_subtract(triep, expected_triep);
+        trie_subtract(triep, src_triep);
+        mu_assert("error, subtract past empty", trie_count_range(triep, 0, 0xFFFF) == 0);
+        trie_free(&src_triep);
+        trie_free(&expected_triep);
+        trie_free(&triep);
+    }
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    const uint16_t* values;
+    size_t n;
+} FdWriter_t;
+
+static void* fd_write(void* argp) {
+    FdWriter_t* writerp = argp;
+    const char* bytp = (const char*)writerp->values;
+    size_t left = writerp->n * sizeof(uint16_t);
+    /* Odd sized writes so the reader sees values split over reads */
+    while(left > 0) {
+        ssize_t written = write(writerp->fd, bytp, left < 4097 ? left : 4097);
+        if(written <= 0) {
+            break;
+        }
+        bytp += written;
+        left -= written;
+    }
+    close(writerp->fd);
+    return NULL;
+}
+
+static char * test_insert_fd() {
+    /* More than two 1MB blocks so the reader thread has to wait for the inserter */
+    size_t n = 1500000;
+    uint16_t* values = malloc(n * sizeof(uint16_t));
+    uint32_t state = 71;
+    for(size_t i = 0; i < n; i++) {
+        values[i] = next_mixed_value(&state, (int)i);
+    }
+    struct sTrie* expected_triep = trie_init();
+    trie_insert_values(expected_triep, values, n);
+
+    /* A regular file is mapped, starting at the current offset */
+    FILE* fp = tmpfile();
+    mu_assert("error, tmpfile", fp != NULL);
+    int fd = fileno(fp);
+    mu_assert("error, file write", write(fd, "x", 1) == 1);
+    mu_assert("error, file write", write(fd, values, n * sizeof(uint16_t)) == (ssize_t)(n * sizeof(uint16_t)));
+    mu_assert("error, file seek", lseek(fd, 1, SEEK_SET) == 1);
+    struct sTrie* triep = trie_init();
+    mu_assert("error, insert file", trie_insert_fd(triep, fd) == 0);
+    char* message = check_same_values(triep, expected_triep);
+    if(message) {
+        return message;
+    }
+    /* The offset is at the end of the file, so a second call adds nothing */
+    mu_assert("error, insert at end", trie_insert_fd(triep, fd) == 0);
+    message = check_same_values(triep, expected_triep);
+    if(message) {
+        return message;
+    }
+    /* An odd size fails after the whole values went in */
+    mu_assert("error, file seek", lseek(fd, 0, SEEK_SET) == 0);
+    trie_reset(triep);
+    mu_assert("error, odd file", trie_insert_fd(triep, fd) == -1);
+    mu_assert("error, odd file count", trie_count_range(triep, 0, 0xFFFF) == n);
+    fclose(fp);
+
+    /* A pipe goes through the block reader */
+    int pipe_fds[2];
+    mu_assert("error, pipe", pipe(pipe_fds) == 0);
+    FdWriter_t writer = { .fd = pipe_fds[1], .values = values, .n = n };
+    pthread_t thread;
+    pthread_create(&thread, NULL, fd_write, &writer);
+    trie_reset(triep);
+    mu_assert("error, insert pipe", trie_insert_fd(triep, pipe_fds[0]) == 0);
+    pthread_join(thread, NULL);
+    close(pipe_fds[0]);
+    message = check_same_values(triep, expected_triep);
+    if(message) {
+        return message;
+    }
+
+    /* A trailing odd byte on a pipe fails too, keeping the values before it */
+    mu_assert("error, pipe", pipe(pipe_fds) == 0);
+    mu_assert("error, pipe write", write(pipe_fds[1], values, 7) == 7);
+    close(pipe_fds[1]);
+    trie_reset(triep);
+    mu_assert("error, odd pipe", trie_insert_fd(triep, pipe_fds[0]) == -1);
+    close(pipe_fds[0]);
+    mu_assert("error, odd pipe count", trie_count_range(triep, 0, 0xFFFF) == 3);
+    mu_assert("error, odd pipe value", trie_count(triep, values[0]) >= 1);
+
+    trie_free(&triep);
+    trie_free(&expected_triep);
+    free(values);
+    return 0;
+}
+
+static int compare_top_entries(const void* ap, const void* bp) {
+    const uint64_t* a = ap;
+    const uint64_t* b = bp;
+    /* Entries are count then value, highest count and then smallest value first */
+    if(a[0] != b[0]) {
+        return (a[0] < b[0]) ? 1 : -1;
+    }
+    return (a[1] > b[1]) - (a[1] < b[1]);
+}
+
+typedef struct {
+    struct sTrie* snapshot;
+    uint64_t total;
+    bool same;
+} SnapshotReader_t;
+
+static void* snapshot_read(void* argp) {
+    SnapshotReader_t* readerp = argp;
+    readerp->same = true;
+    for(int i = 0; i < 200; i++) {
+        uint16_t median = trie_quantile(readerp->snapshot, 0.5);
+        readerp->same &= (trie_count_range(readerp->snapshot, 0, 0xFFFF) == readerp->total);
+        readerp->same &= (trie_rank(readerp->snapshot, median) <= readerp->total / 2);
+    }
+    return NULL;
+}
+
+static char * test_snapshot() {
+    const struct sTrieConfig configs[] = {
+        { 0 },
+        { .counted = true },
+        { .counted = true, .compact_links = true },
+        { .compact_counts = true },
+        { .vertical = true, .direct_levels = 2, .counted = true },
+        { .hot_values = true },
+    };
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        struct sTrie* triep = make_mixed_trie(&configs[c], 89, 50000);
+        struct sTrie* expected_triep = make_mixed_trie(NULL, 89, 50000);
+        struct sTrie* snapshotp = trie_snapshot(triep);
+        char * message = check_same_values(snapshotp, expected_triep);
+        if(message) {
+            return message;
+        }
+        mu_assert("error, snapshot rank", trie_rank(snapshotp, 0x2345) == trie_rank(expected_triep, 0x2345));
+        mu_assert("error, snapshot config", snapshotp->config.counted == configs[c].counted && snapshotp->direct == NULL);
+        mu_assert("error, snapshot read only", snapshotp->read_only && !triep->read_only);
+#ifndef NDEBUG
+        /* An insert into the snapshot trips an assert */
+        fflush(NULL);
+        pid_t child = fork();
+        if(child == 0) {
+            trie_insert_value(snapshotp, 1234);
+            _exit(0);
+        }
+        int status;
+        mu_assert("error, snapshot insert", waitpid(child, &status, 0) == child && WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+#endif
+
+        /* Readers keep querying the snapshot while the source takes more inserts */
+        SnapshotReader_t reader = { .snapshot = snapshotp, .total = trie_count_range(expected_triep, 0, 0xFFFF) };
+        pthread_t thread;
+        pthread_create(&thread, NULL, snapshot_read, &reader);
+        uint32_t state = 97;
+        for(int i = 0; i < 50000; i++) {
+            trie_insert_value(triep, next_mixed_value(&state, i));
+        }
+        pthread_join(thread, NULL);
+        mu_assert("error, snapshot reader", reader.same);
+        message = check_same_values(snapshotp, expected_triep);
+        if(message) {
+            return message;
+        }
+        mu_assert("error, snapshot source", trie_count_range(triep, 0, 0xFFFF) == 100000);
+        trie_free_async(&snapshotp);
+        trie_free(&expected_triep);
+        trie_free(&triep);
+    }
+    trie_free_async_wait();
+    return 0;
+}
+
+static char * test_set_algebra() {
+    const struct sTrieConfig configs[] = {
+        { .counted = true },
+        { 0 },
+        { .compact_links = true, .counted = true },
+        { .direct_levels = 2 },
+    };
+    struct sTrie* triesp[NELEMS(configs)];
+    uint64_t (*counts)[0x10000] = calloc(NELEMS(configs), sizeof(*counts));
+    uint64_t* totals = calloc(0x10000, sizeof(*totals));
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        triesp[c] = trie_init_ex(&configs[c]);
+        /* Overlapping but different mixes, sparse in some places and dense in others */
+        uint32_t state = 83 + c;
+        for(int i = 0; i < 40000; i++) {
+            uint16_t value = next_mixed_value(&state, i);
+            value = (i % 5 == 0) ? (uint16_t)(value * (c + 1)) : value;
+            trie_insert_value(triesp[c], value);
+            ++counts[c][value];
+            ++totals[value];
+        }
+    }
+    for(size_t a = 0; a < NELEMS(configs); a++) {
+        for(size_t b = 0; b < NELEMS(configs); b++) {
+            uint64_t expected = 0;
+            for(uint32_t v = 0; v <= 0xFFFF; v++) {
+                expected += (counts[a][v] < counts[b][v]) ? counts[a][v] : counts[b][v];
+            }
+            mu_assert("error, intersect count", trie_intersect_count(triesp[a], triesp[b]) == expected);
+        }
+    }
+    struct sTrie* empty_triep = trie_init();
+    mu_assert("error, intersect empty", trie_intersect_count(triesp[0], empty_triep) == 0);
+
+    const struct sTrieConfig counted_config = { .counted = true };
+    struct sTrie* union_triep = trie_union(triesp, NELEMS(triesp), &counted_config);
+    mu_assert("error, union", union_triep != NULL);
+    for(uint32_t v = 0; v <= 0xFFFF; v++) {
+        mu_assert("error, union count", trie_count(union_triep, v) == totals[v]);
+    }
+
+    uint64_t (*expected_top)[2] = calloc(0x10000, sizeof(*expected_top));
+    size_t distinct = 0;
+    for(uint32_t v = 0; v <= 0xFFFF; v++) {
+        if(totals[v] > 0) {
+            expected_top[distinct][0] = totals[v];
+            expected_top[distinct][1] = v;
+            ++distinct;
+        }
+    }
+    qsort(expected_top, distinct, sizeof(*expected_top), compare_top_entries);
+    uint16_t* values = malloc(0x10000 * sizeof(*values));
+    uint64_t* top_counts = malloc(0x10000 * sizeof(*top_counts));
+    const size_t ks[] = { 1, 10, 100, 5000, 0x10000 };
+    for(size_t i = 0; i < NELEMS(ks); i++) {
+        /* All of the tries, and the single counted one which gets pruned the most */
+        size_t found = trie_top_k(triesp, NELEMS(triesp), ks[i], values, top_counts);
+        mu_assert("error, top k found", found == ((ks[i] < distinct) ? ks[i] : distinct));
+        for(size_t j = 0; j < found; j++) {
+            mu_assert("error, top k entry", top_counts[j] == expected_top[j][0] && values[j] == expected_top[j][1]);
+        }
+        found = trie_top_k(&union_triep, 1, ks[i], values, top_counts);
+        mu_assert("error, counted top k found", found == ((ks[i] < distinct) ? ks[i] : distinct));
+        for(size_t j = 0; j < found; j++) {
+            mu_assert("error, counted top k entry", top_counts[j] == expected_top[j][0] && values[j] == expected_top[j][1]);
+        }
+    }
+    mu_assert("error, top k of nothing", trie_top_k(&empty_triep, 1, 10, values, top_counts) == 0);
+    /* Without counted tries the counts get added up in a table instead */
+    struct sTrie* uncounted_triesp[] = { triesp[1], triesp[3] };
+    size_t found = trie_top_k(uncounted_triesp, NELEMS(uncounted_triesp), 50, values, top_counts);
+    mu_assert("error, uncounted top k found", found == 50);
+    for(size_t j = 0; j < found; j++) {
+        uint64_t count = counts[1][values[j]] + counts[3][values[j]];
+        mu_assert("error, uncounted top k count", top_counts[j] == count);
+        mu_assert("error, uncounted top k order", j == 0 || top_counts[j] < top_counts[j-1] || (top_counts[j] == top_counts[j-1] && values[j] > values[j-1]));
+    }
+    for(uint32_t v = 0; v <= 0xFFFF; v++) {
+        uint64_t count = counts[1][v] + counts[3][v];
+        bool listed = false;
+        for(size_t j = 0; j < found; j++) {
+            listed |= (values[j] == v);
+        }
+        mu_assert("error, uncounted top k missed", listed || count < top_counts[found-1] ||
+                  (count == top_counts[found-1] && v > values[found-1]));
+    }
+
+    free(values);
+    free(top_counts);
+    free(expected_top);
+    trie_free(&union_triep);
+    trie_free(&empty_triep);
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        trie_free(&triesp[c]);
+    }
+    free(totals);
+    free(counts);
+    return 0;
+}
+
+static char * test_compact() {
+    const struct sTrieConfig configs[] = {
+        { 0 },
+        { .counted = true },
+        { .vertical = true, .counted = true },
+        { .direct_levels = 2, .counted = true },
+        { .compact_counts = true },
+        { .compact_links = true, .counted = true },
+    };
+    for(size_t c = 0; c < NELEMS(configs); c++) {
+        /* Bursts leave slabs behind that hold only a few values once most are removed */
+        struct sTrie* triep = make_mixed_trie(&configs[c], 73, 60000);
+        struct sTrie* expected_triep = trie_init();
+        uint32_t state = 73;
+        for(int i = 0; i < 60000; i++) {
+            uint16_t value = next_mixed_value(&state, i);
+            if(i % 16 == 3) {
+                trie_insert_value(expected_triep, value);
+            } else {
+                trie_remove_value(triep, value);
+            }
+        }
+        TrieStats_t before, after;
+        trie_get_stats(triep, &before);
+        trie_compact(triep);
+        trie_get_stats(triep, &after);
+        char * message = check_same_values(triep, expected_triep);
+        if(message) {
+            return message;
+        }
+        mu_assert("error, compact rank", trie_rank(triep, 0x1234) == trie_rank(expected_triep, 0x1234));
+        mu_assert("error, compact quantile", trie_quantile(triep, 0.9) == trie_quantile(expected_triep, 0.9));
+        mu_assert("error, compact range", trie_count_range(triep, 300, 0x8000) == trie_count_range(expected_triep, 300, 0x8000));
+        mu_assert("error, compact shrinks", after.bytes_used <= before.bytes_used && after.travel_nodes <= before.travel_nodes);
+        mu_assert("error, compact one block", triep->arena.chunks != NULL && triep->arena.chunks->next == NULL);
+        for(size_t i = 0; i < NELEMS(triep->lanes); i++) {
+            mu_assert("error, compact lanes", triep->lanes[i].chunks == NULL);
+        }
+        mu_assert("error, compact block size", after.bytes_used == triep->arena.bytes_used);
+
+        /* Inserts carry on as usual afterwards */
+        state = 79;
+        for(int i = 0; i < 20000; i++) {
+            uint16_t value = next_mixed_value(&state, i);
+            trie_insert_value(triep, value);
+            trie_insert_value(expected_triep, value);
+        }
+        message = check_same_values(triep, expected_triep);
+        if(message) {
+            return message;
+        }
+        mu_assert("error, rank after compact", trie_rank(triep, 0x4321) == trie_rank(expected_triep, 0x4321));
+        /* And a full trie compacts without losing anything */
+        trie_compact(triep);
+        message = check_same_values(triep, expected_triep);
+        if(message) {
+            return message;
+        }
+        trie_free(&expected_triep);
+        trie_free(&triep);
+    }
+    return 0;
+}
+
+static char * test_window() {
+    const struct sTrieConfig counted_config = { .counted = true };
+    mu_assert("error, empty window", trie_window_init(0, NULL) == NULL);
+    struct sTrieWindow* windowp = trie_window_init(4, &counted_config);
+    mu_assert("error, window init", windowp != NULL);
+    mu_assert("error, empty window quantile", trie_window_quantile(windowp, 0.5) == 0);
+
+    uint32_t state = 61;
+    uint16_t values[10][3000];
+    for(int r = 0; r < 10; r++) {
+        for(size_t i = 0; i < NELEMS(values[r]); i++) {
+            uint16_t value = next_random(&state);
+            values[r][i] = (i % 3 == 0) ? 0 : (i % 3 == 1) ? (value & 0xFF) + 1000 * r : value;
+        }
+        if(r > 0) {
+            trie_window_rotate(windowp);
+        }
+        if(r % 2 == 0) {
+            trie_window_insert_values(windowp, values[r], NELEMS(values[r]));
+        } else {
+            for(size_t i = 0; i < NELEMS(values[r]); i++) {
+                trie_window_insert_value(windowp, values[r][i]);
+            }
+        }
+        /* The window holds the last 4 rounds */
+        struct sTrie* expected_triep = trie_init();
+        for(int w = (r < 3) ? 0 : r - 3; w <= r; w++) {
+            trie_insert_values(expected_triep, values[w], NELEMS(values[w]));
+        }
+        for(uint32_t v = 0; v <= 0xFFFF; v += 37) {
+            mu_assert("error, window count", trie_window_count(windowp, v) == trie_count(expected_triep, v));
+            mu_assert("error, window rank", trie_window_rank(windowp, v) == trie_rank(expected_triep, v));
+        }
+        mu_assert("error, window range", trie_window_count_range(windowp, 500, 9000) == trie_count_range(expected_triep, 500, 9000));
+        const double qs[] = { 0.0, 0.2, 0.5, 0.9, 0.99, 1.0 };
+        for(size_t i = 0; i < NELEMS(qs); i++) {
+            mu_assert("error, window quantile", trie_window_quantile(windowp, qs[i]) == trie_quantile(expected_triep, qs[i]));
+        }
+        trie_free(&expected_triep);
+    }
+
+    /* Rotating reuses the memory of the interval it drops */
+    size_t reserved = 0;
+    for(uint32_t i = 0; i < windowp->interval_count; i++) {
+        reserved += windowp->intervals[i]->arena.bytes_reserved;
+    }
+    for(int r = 0; r < 8; r++) {
+        trie_window_rotate(windowp);
+        trie_window_insert_values(windowp, values[r], NELEMS(values[r]));
+    }
+    size_t reserved_after = 0;
+    for(uint32_t i = 0; i < windowp->interval_count; i++) {
+        reserved_after += windowp->intervals[i]->arena.bytes_reserved;
+    }
+    mu_assert("error, window memory not reused", reserved_after == reserved);
+    mu_assert("error, window total", trie_window_count_range(windowp, 0, 0xFFFF) == 4 * NELEMS(values[0]));
+    trie_window_free(&windowp);
+    mu_assert("error, window free", windowp == NULL);
+    return 0;
+}
+
+/* Distinct values and their counts as reported by a wide trie visit */
+typedef struct {
+    uint64_t values[65536];
+    uint64_t counts[65536];
+    size_t distinct;
+} WideVisit_t;
+
+static bool wide32_visitor(void* ctxp, uint32_t value, uint64_t count) {
+    WideVisit_t* visitp = ctxp;
+    visitp->values[visitp->distinct] = value;
+    visitp->counts[visitp->distinct++] = count;
+    return visitp->distinct < NELEMS(visitp->values);
+}
+
+static bool wide64_visitor(void* ctxp, uint64_t value, uint64_t count) {
+    WideVisit_t* visitp = ctxp;
+    visitp->values[visitp->distinct] = value;
+    visitp->counts[visitp->distinct++] = count;
+    return visitp->distinct < NELEMS(visitp->values);
+}
+
+static bool wide16_visitor(void* ctxp, uint16_t value, uint64_t count) {
+    WideVisit_t* visitp = ctxp;
+    visitp->values[visitp->distinct] = value;
+    visitp->counts[visitp->distinct++] = count;
+    return visitp->distinct < NELEMS(visitp->values);
+}
+
+static int compare_u64(const void* ap, const void* bp) {
+    uint64_t a = *(const uint64_t*)ap, b = *(const uint64_t*)bp;
+    return (a > b) - (a < b);
+}
+
+/* Values for the wide tries, with runs deep enough to reach the count nodes */
+static void make_wide_values(uint64_t* values, size_t n, uint64_t max) {
+    uint32_t state = 53;
+    for(size_t i = 0; i < n; i++) {
+        uint64_t r = ((uint64_t)next_random(&state) << 48) | ((uint64_t)next_random(&state) << 32) |
+                     ((uint64_t)next_random(&state) << 16) | next_random(&state);
+        values[i] = (i % 5 == 0) ? 0 : (i % 5 == 1) ? (r & 0x7) + (max >> 1) : (i % 5 == 2) ? max - (r & 0x3) : r & max;
+    }
+    values[n-1] = max;
+}
+
+/* The visit must report the sorted values run by run */
+static char * check_wide_visit(const WideVisit_t* visitp, const uint64_t* sorted, size_t n) {
+    size_t i = 0;
+    for(size_t d = 0; d < visitp->distinct; d++) {
+        mu_assert("error, wide visit value", i < n && visitp->values[d] == sorted[i]);
+        for(uint64_t c = 0; c < visitp->counts[d]; c++, i++) {
+            mu_assert("error, wide visit count", i < n && sorted[i] == visitp->values[d]);
+        }
+    }
+    mu_assert("error, wide visit short", i == n);
+    return 0;
+}
+
+static char * test_wide_tries() {
+    const size_t n = 20000;
+    uint64_t* values = malloc(n * sizeof(*values));
+    uint64_t* sorted = malloc(n * sizeof(*sorted));
+    uint32_t* values32 = malloc(n * sizeof(*values32));
+    WideVisit_t* visitp = calloc(1, sizeof(*visitp));
+    char * message;
+
+    make_wide_values(values, n, 0xFFFFFFFF);
+    for(size_t i = 0; i < n; i++) {
+        values32[i] = values[i];
+    }
+    memcpy(sorted, values, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), compare_u64);
+    struct sTrie32* trie32p = trie32_init();
+    trie32_insert_values(trie32p, values32, n / 2);
+    for(size_t i = n / 2; i < n; i++) {
+        trie32_insert_value(trie32p, values32[i]);
+    }
+    trie32_visit(trie32p, wide32_visitor, visitp);
+    if((message = check_wide_visit(visitp, sorted, n))) {
+        return message;
+    }
+    mu_assert("error, wide32 zeros", trie32_count(trie32p, 0) == n / 5);
+    mu_assert("error, wide32 max", trie32_count(trie32p, 0xFFFFFFFF) == trie32_count_range(trie32p, 0xFFFFFFFF, 0xFFFFFFFF));
+    mu_assert("error, wide32 everything", trie32_count_range(trie32p, 0, 0xFFFFFFFF) == n);
+    for(size_t i = 0; i < 200; i++) {
+        uint32_t lo = values32[i * 7], hi = lo + (values32[i * 11] >> 4);
+        hi = hi < lo ? 0xFFFFFFFF : hi;
+        uint64_t expected = 0, count = 0;
+        for(size_t j = 0; j < n; j++) {
+            expected += (sorted[j] >= lo && sorted[j] <= hi);
+            count += (sorted[j] == lo);
+        }
+        mu_assert("error, wide32 range", trie32_count_range(trie32p, lo, hi) == expected);
+        mu_assert("error, wide32 count", trie32_count(trie32p, lo) == count);
+    }
+    uint64_t hot_count = trie32_count(trie32p, 0x80000003);
+    uint64_t cold_count = trie32_count(trie32p, 0x12345678);
+    trie32_insert_value_n(trie32p, 0x80000003, 1000);
+    trie32_insert_value_n(trie32p, 0x12345678, 100);
+    mu_assert("error, wide32 weighted", trie32_count(trie32p, 0x80000003) == hot_count + 1000);
+    mu_assert("error, wide32 weighted new", trie32_count(trie32p, 0x12345678) == cold_count + 100);
+    trie32_reset(trie32p);
+    mu_assert("error, wide32 reset", trie32_count_range(trie32p, 0, 0xFFFFFFFF) == 0);
+    trie32_free(&trie32p);
+    mu_assert("error, wide32 free", trie32p == NULL);
+
+    make_wide_values(values, n, UINT64_MAX);
+    memcpy(sorted, values, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), compare_u64);
+    struct sTrie64* trie64p = trie64_init();
+    trie64_insert_values(trie64p, values, n);
+    visitp->distinct = 0;
+    trie64_visit(trie64p, wide64_visitor, visitp);
+    if((message = check_wide_visit(visitp, sorted, n))) {
+        return message;
+    }
+    mu_assert("error, wide64 everything", trie64_count_range(trie64p, 0, UINT64_MAX) == n);
+    for(size_t i = 0; i < 200; i++) {
+        uint64_t lo = values[i * 7], hi = lo + (values[i * 11] >> 4);
+        hi = hi < lo ? UINT64_MAX : hi;
+        uint64_t expected = 0, count = 0;
+        for(size_t j = 0; j < n; j++) {
+            expected += (sorted[j] >= lo && sorted[j] <= hi);
+            count += (sorted[j] == lo);
+        }
+        mu_assert("error, wide64 range", trie64_count_range(trie64p, lo, hi) == expected);
+        mu_assert("error, wide64 count", trie64_count(trie64p, lo) == count);
+    }
+    trie64_free(&trie64p);
+
+    /* A weighted insert bursts its way down to the count nodes */
+    trie64p = trie64_init();
+    trie64_insert_value_n(trie64p, 0xDEADBEEFCAFEF00D, 1000);
+    trie64_insert_value(trie64p, 0xDEADBEEFCAFEF00C);
+    mu_assert("error, wide64 weighted", trie64_count(trie64p, 0xDEADBEEFCAFEF00D) == 1000);
+    mu_assert("error, wide64 weighted neighbour", trie64_count_range(trie64p, 0xDEADBEEFCAFEF00C, UINT64_MAX) == 1001);
+    trie64_free(&trie64p);
+
+    free(visitp);
+    free(values32);
+    free(sorted);
+    free(values);
+    return 0;
+}
+
+static char * test_wide_fanout() {
+    struct sTrie* triep = make_mixed_trie(NULL, 59, 60000);
+    WideVisit_t* expectedp = calloc(1, sizeof(*expectedp));
+    WideVisit_t* visitp = calloc(1, sizeof(*visitp));
+    trie_visit(triep, wide16_visitor, expectedp);
+
+    struct sTrie16x16* trie16x16p = trie16x16_init();
+    struct sTrie16x64* trie16x64p = trie16x64_init();
+    uint32_t state = 59;
+    uint16_t values[60000];
+    for(int i = 0; i < 60000; i++) {
+        uint16_t value = next_random(&state);
+        values[i] = (i % 4 == 0) ? 0 : (i % 4 == 1) ? (value & 0x7) + 300 : (i % 4 == 2) ? value & 0xFFF : value;
+        trie16x16_insert_value(trie16x16p, values[i]);
+    }
+    trie16x64_insert_values(trie16x64p, values, NELEMS(values));
+
+    trie16x16_visit(trie16x16p, wide16_visitor, visitp);
+    mu_assert("error, 16 way distinct", visitp->distinct == expectedp->distinct);
+    mu_assert("error, 16 way values", memcmp(visitp->values, expectedp->values, visitp->distinct * sizeof(visitp->values[0])) == 0);
+    mu_assert("error, 16 way counts", memcmp(visitp->counts, expectedp->counts, visitp->distinct * sizeof(visitp->counts[0])) == 0);
+    visitp->distinct = 0;
+    trie16x64_visit(trie16x64p, wide16_visitor, visitp);
+    mu_assert("error, 64 way distinct", visitp->distinct == expectedp->distinct);
+    mu_assert("error, 64 way values", memcmp(visitp->values, expectedp->values, visitp->distinct * sizeof(visitp->values[0])) == 0);
+    mu_assert("error, 64 way counts", memcmp(visitp->counts, expectedp->counts, visitp->distinct * sizeof(visitp->counts[0])) == 0);
+
+    for(uint32_t lo = 0; lo <= 0xFFFF; lo += 331) {
+        uint16_t hi = (lo + (lo * 7 & 0x3FFF)) > 0xFFFF ? 0xFFFF : lo + (lo * 7 & 0x3FFF);
+        mu_assert("error, 16 way count", trie16x16_count(trie16x16p, lo) == trie_count(triep, lo));
+        mu_assert("error, 64 way count", trie16x64_count(trie16x64p, lo) == trie_count(triep, lo));
+        mu_assert("error, 16 way range", trie16x16_count_range(trie16x16p, lo, hi) == trie_count_range(triep, lo, hi));
+        mu_assert("error, 64 way range", trie16x64_count_range(trie16x64p, lo, hi) == trie_count_range(triep, lo, hi));
+    }
+    /* Bursts from the base node straight down to the count nodes */
+    trie16x64_reset(trie16x64p);
+    trie16x64_insert_value_n(trie16x64p, 4242, 1000);
+    mu_assert("error, 64 way weighted", trie16x64_count(trie16x64p, 4242) == 1000 && trie16x64_count_range(trie16x64p, 0, 0xFFFF) == 1000);
+
+    trie16x16_free(&trie16x16p);
+    trie16x64_free(&trie16x64p);
+    free(visitp);
+    free(expectedp);
+    trie_free(&triep);
+    return 0;
+}
+
 static char * all_tests() {
      mu_run_test(test_simple);
      mu_run_test(test_simple_burst);
      mu_run_test(test_simple_counting_bucket);
      mu_run_test(test_low_number_to_same_bucket_after_burst);
+     mu_run_test(test_batch_insert);
+     mu_run_test(test_batch_insert_matches_single_inserts);
+     mu_run_test(test_interleaved_batch_insert);
+     mu_run_test(test_count);
+     mu_run_test(test_count_range_matches_oracle);
+     mu_run_test(test_rank_and_quantile);
+     mu_run_test(test_counted_rank_and_quantile);
+     mu_run_test(test_counted_trie_output);
+     mu_run_test(test_reset_reuses_memory);
+     mu_run_test(test_free_async);
+     mu_run_test(test_iterator);
+     mu_run_test(test_print_values_parallel);
+     mu_run_test(test_print_values_format);
+     mu_run_test(test_visit_matches_oracle);
+     mu_run_test(test_concurrent_insert);
+     mu_run_test(test_concurrent_counted_insert);
+     mu_run_test(test_merge);
+     mu_run_test(test_weighted_insert);
+     mu_run_test(test_weighted_insert_matches_single_inserts);
+     mu_run_test(test_serialize_round_trip);
+     mu_run_test(test_image_mmap);
+     mu_run_test(test_stats);
+     mu_run_test(test_vertical_layout);
+     mu_run_test(test_direct_levels);
+     mu_run_test(test_compact_counts);
+     mu_run_test(test_compact_links);
+     mu_run_test(test_window);
+     mu_run_test(test_insert_fd);
+     mu_run_test(test_remove);
+     mu_run_test(test_compact);
+     mu_run_test(test_set_algebra);
+     mu_run_test(test_snapshot);
+     mu_run_test(test_hot_values);
+     mu_run_test(test_wide_tries);
+     mu_run_test(test_wide_fanout);
      return 0;
  }
 int main(void) {
@@ -0,0 +1,72 @@
+/* trie.wide.h
+ *
+ * Declarations of a trie over other key widths and fan-outs. This header is a template,
+ * include it once per instance with these defined:
+ *  TRIE_WIDE_TYPE       type name, Trie32 gives struct sTrie32 and Trie32Node_t
+ *  TRIE_WIDE_PREFIX     function prefix, trie32 gives trie32_init and friends
+ *  TRIE_WIDE_KEY        unsigned key type
+ *  TRIE_WIDE_LEVEL_BITS bits of the key consumed per travel level
+ * The parameters are undefined again at the end. trie.h instantiates it for uint32_t
+ * and uint64_t keys, and for uint16_t keys with 4 and 6 bits per level. trie.wide.impl.h
+ * holds the matching definitions.
+ *
+ * The layout is that of the 16 bit trie. A node holds one travel link per index of a
+ * level, so with 3 bits per level it is one cache line: 16 uint32_t or 8 uint64_t
+ * data slots. 4 bits make 16 way nodes over 2 cache lines and 6 bits 64 way nodes over
+ * 8, which takes a 16 bit trie from 5 travel levels down to 3 or 2 for fewer dependent
+ * loads per insert, paid for with bigger bursts and longer data node shifts. The bits
+ * left over below the last travel level pick the bucket of a count node. These tries
+ * only do the basics, none of the sTrieConfig options apply to them.
+ */
+#ifndef TRIE_WIDE_TYPE
+#error "Define TRIE_WIDE_TYPE, TRIE_WIDE_PREFIX, TRIE_WIDE_KEY and TRIE_WIDE_LEVEL_BITS before including trie.wide.h"
+#endif
+
+#ifndef TRIE_WIDE_CAT
+#define TRIE_WIDE_CAT_(__a, __b) __a##__b
+#define TRIE_WIDE_CAT(__a, __b) TRIE_WIDE_CAT_(__a, __b)
+#endif
+
+#define TRIE_WIDE_NAME(__suffix) TRIE_WIDE_CAT(TRIE_WIDE_TYPE, __suffix)
+#define TRIE_WIDE_FN(__suffix) TRIE_WIDE_CAT(TRIE_WIDE_PREFIX, __suffix)
+#define TRIE_WIDE_STRUCT(__suffix) TRIE_WIDE_CAT(s, TRIE_WIDE_NAME(__suffix))
+
+typedef struct TRIE_WIDE_STRUCT(Node) {
+    union {
+        TRIE_WIDE_KEY data[(sizeof(void*) << TRIE_WIDE_LEVEL_BITS) / sizeof(TRIE_WIDE_KEY)];
+        struct TRIE_WIDE_STRUCT(Node)* link[1 << TRIE_WIDE_LEVEL_BITS];
+    };
+} CACHE_ALIGNED TRIE_WIDE_NAME(Node_t);
+
+typedef struct TRIE_WIDE_STRUCT() {
+    struct TRIE_WIDE_STRUCT(Node)* base_node;
+    uint64_t number_of_zeros;
+    struct sTrieArena arena;
+} TRIE_WIDE_NAME(_t);
+
+/* Called once per distinct value in sorted order. Return false to stop the walk */
+typedef bool (*TRIE_WIDE_NAME(Visitor_t))(void* ctxp, TRIE_WIDE_KEY value, uint64_t count);
+
+struct TRIE_WIDE_STRUCT()* TRIE_WIDE_FN(_init)(void);
+void TRIE_WIDE_FN(_free)(struct TRIE_WIDE_STRUCT()**);
+/* Empty the trie but keep its memory around for the next round of inserts */
+void TRIE_WIDE_FN(_reset)(struct TRIE_WIDE_STRUCT()* triep);
+void TRIE_WIDE_FN(_insert_value)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_KEY value);
+/* Insert value n times. Walks the trie once instead of n times */
+void TRIE_WIDE_FN(_insert_value_n)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_KEY value, uint64_t n);
+/* Insert n values at once. Equivalent to calling insert_value on each of them */
+void TRIE_WIDE_FN(_insert_values)(struct TRIE_WIDE_STRUCT()* triep, const TRIE_WIDE_KEY* values, size_t n);
+/* Number of times value has been inserted */
+uint64_t TRIE_WIDE_FN(_count)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_KEY value);
+/* Number of inserted values v with lo <= v <= hi */
+uint64_t TRIE_WIDE_FN(_count_range)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_KEY lo, TRIE_WIDE_KEY hi);
+/* Returns false if the visitor stopped the walk early */
+bool TRIE_WIDE_FN(_visit)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_NAME(Visitor_t) visitor, void* ctxp);
+
+#undef TRIE_WIDE_NAME
+#undef TRIE_WIDE_FN
+#undef TRIE_WIDE_STRUCT
+#undef TRIE_WIDE_TYPE
+#undef TRIE_WIDE_PREFIX
+#undef TRIE_WIDE_KEY
+#undef TRIE_WIDE_LEVEL_BITS
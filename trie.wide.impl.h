@@ -0,0 +1,343 @@
+/* trie.wide.impl.h
+ *
+ * Definitions for the tries declared by trie.wide.h. Included from trie.c with the same
+ * parameters as the declarations, so the wide tries share its arena allocator and
+ * pointer tagging. Every shift and mask is a constant expression of the parameters, so
+ * each instance compiles down to the same straight line code the 16 bit trie gets from
+ * its tables.
+ */
+#ifndef TRIE_WIDE_TYPE
+#error "Define TRIE_WIDE_TYPE, TRIE_WIDE_PREFIX, TRIE_WIDE_KEY and TRIE_WIDE_LEVEL_BITS before including trie.wide.impl.h"
+#endif
+
+#define TRIE_WIDE_NAME(__suffix) TRIE_WIDE_CAT(TRIE_WIDE_TYPE, __suffix)
+#define TRIE_WIDE_FN(__suffix) TRIE_WIDE_CAT(TRIE_WIDE_PREFIX, __suffix)
+#define TRIE_WIDE_STRUCT(__suffix) TRIE_WIDE_CAT(s, TRIE_WIDE_NAME(__suffix))
+
+#define TRIE_WIDE_NODE TRIE_WIDE_NAME(Node_t)
+#define TRIE_WIDE_KEY_BITS ( 8 * sizeof(TRIE_WIDE_KEY) )
+#define TRIE_WIDE_FANOUT ( 1 << TRIE_WIDE_LEVEL_BITS )
+#define TRIE_WIDE_SLOTS ( NELEMS(((TRIE_WIDE_NODE*)0)->data) )
+/* Depth of the count nodes. The bits left below the last travel level, between 1 and
+ * TRIE_WIDE_LEVEL_BITS of them, pick the count node bucket */
+#define TRIE_WIDE_MAX_DEPTH ( (TRIE_WIDE_KEY_BITS - 1) / TRIE_WIDE_LEVEL_BITS )
+#define TRIE_WIDE_COUNT_BUCKETS ( (size_t)1 << (TRIE_WIDE_KEY_BITS - TRIE_WIDE_MAX_DEPTH * TRIE_WIDE_LEVEL_BITS) )
+
+_Static_assert(sizeof(TRIE_WIDE_NODE) % CACHE_LINE_SIZE == 0, "Wide trie nodes must fill whole cache lines");
+_Static_assert(TRIE_WIDE_SLOTS >= 2, "A wide data node needs room for at least two keys");
+
+/* Bits of value below the index of a node at depth */
+static inline uint8_t TRIE_WIDE_FN(__shift)(uint8_t depth) {
+    return depth >= TRIE_WIDE_MAX_DEPTH ? 0 : TRIE_WIDE_KEY_BITS - TRIE_WIDE_LEVEL_BITS * (depth + 1);
+}
+
+static inline uint16_t TRIE_WIDE_FN(__idx)(TRIE_WIDE_KEY value, uint8_t depth) {
+    if(depth == TRIE_WIDE_MAX_DEPTH) {
+        return value & (TRIE_WIDE_COUNT_BUCKETS - 1);
+    }
+    return (value >> TRIE_WIDE_FN(__shift)(depth)) & (TRIE_WIDE_FANOUT - 1);
+}
+
+/* The values under a node at depth differ only in these bits. depth must be at least 1 */
+static inline TRIE_WIDE_KEY TRIE_WIDE_FN(__span_mask)(uint8_t depth) {
+    return ((TRIE_WIDE_KEY)1 << (TRIE_WIDE_KEY_BITS - TRIE_WIDE_LEVEL_BITS * depth)) - 1;
+}
+
+static NodeType_t TRIE_WIDE_FN(__node_type)(TRIE_WIDE_NODE* nodep, uint8_t depth) {
+    if(depth == TRIE_WIDE_MAX_DEPTH) {
+        return NODE_TYPE_COUNT;
+    }
+    /* A data node bursts as soon as data[0] is used, so data[0] overlaps the tag bit of
+     * link[0] the same way it does in the 16 bit trie */
+    return (nodep->data[0] & 0x1) ? NODE_TYPE_TRAVEL : NODE_TYPE_DATA;
+}
+
+static uint64_t* TRIE_WIDE_FN(__count_node_bucket)(TRIE_WIDE_NODE* nodep, TRIE_WIDE_KEY value) {
+    return &((uint64_t*)nodep)[TRIE_WIDE_FN(__idx)(value, TRIE_WIDE_MAX_DEPTH)];
+}
+
+/* The count nodes under the last travel level are packed like those of the 16 bit trie */
+static TRIE_WIDE_NODE* TRIE_WIDE_FN(__slab_child)(TRIE_WIDE_NODE* slabp, uint8_t depth, uint16_t i) {
+    if(depth == TRIE_WIDE_MAX_DEPTH - 1) {
+        return (TRIE_WIDE_NODE*)((uint64_t*)slabp + i * TRIE_WIDE_COUNT_BUCKETS);
+    }
+    return &slabp[i];
+}
+
+static TRIE_WIDE_NODE* TRIE_WIDE_FN(__alloc_slab)(struct TRIE_WIDE_STRUCT()* triep, uint8_t depth) {
+    size_t size = TRIE_WIDE_FANOUT * sizeof(TRIE_WIDE_NODE);
+    if(depth == TRIE_WIDE_MAX_DEPTH - 1) {
+        size = TRIE_WIDE_FANOUT * TRIE_WIDE_COUNT_BUCKETS * sizeof(uint64_t);
+        size = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    }
+    return trie__arena_alloc(&triep->arena, size);
+}
+
+static void TRIE_WIDE_FN(__data_node_insert)(TRIE_WIDE_NODE* nodep, TRIE_WIDE_KEY value) {
+    TRIE_WIDE_KEY* current_elemp = &nodep->data[TRIE_WIDE_SLOTS - 1];
+    while(*current_elemp != 0 && *current_elemp < value) {
+        assert(current_elemp != &nodep->data[0]);
+        --current_elemp;
+    }
+    if(*current_elemp != 0) {
+        memmove(&nodep->data[0], &nodep->data[1], (uint8_t*)current_elemp - (uint8_t*)nodep->data);
+    }
+    *current_elemp = value;
+}
+
+static uint16_t TRIE_WIDE_FN(__data_node_free_slots)(TRIE_WIDE_NODE* nodep) {
+    uint16_t free_slots = 0;
+    while(free_slots < TRIE_WIDE_SLOTS && nodep->data[free_slots] == 0) {
+        ++free_slots;
+    }
+    return free_slots;
+}
+
+/* Insert n copies of a non-zero value, n must be at most the number of free slots */
+static void TRIE_WIDE_FN(__data_node_insert_n)(TRIE_WIDE_NODE* nodep, TRIE_WIDE_KEY value, uint16_t n) {
+    uint16_t first_used = TRIE_WIDE_FN(__data_node_free_slots)(nodep);
+    assert(n <= first_used);
+    uint16_t slot = TRIE_WIDE_SLOTS;
+    while(slot > first_used && nodep->data[slot-1] < value) {
+        --slot;
+    }
+    memmove(&nodep->data[first_used - n], &nodep->data[first_used], (slot - first_used) * sizeof(nodep->data[0]));
+    for(uint16_t i = slot - n; i < slot; i++) {
+        nodep->data[i] = value;
+    }
+}
+
+/* Turn a full data node at depth into a travel node, see trie__burst_data_node_into */
+static void TRIE_WIDE_FN(__burst_data_node)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_NODE* nodep, uint8_t depth) {
+    TRIE_WIDE_NODE* node_to_burst = NULL;
+    TRIE_WIDE_NODE* all_new_nodesp = TRIE_WIDE_FN(__alloc_slab)(triep, depth);
+    if(depth == TRIE_WIDE_MAX_DEPTH - 1) {
+        for(uint16_t i = 0; i < TRIE_WIDE_SLOTS; i++) {
+            TRIE_WIDE_KEY value = nodep->data[i];
+            TRIE_WIDE_NODE* countp = TRIE_WIDE_FN(__slab_child)(all_new_nodesp, depth, TRIE_WIDE_FN(__idx)(value, depth));
+            ++(*TRIE_WIDE_FN(__count_node_bucket)(countp, value));
+        }
+    } else {
+        /* Smallest first, so every element is appended to its subnode */
+        uint16_t fill[TRIE_WIDE_FANOUT] = {0};
+        for(uint16_t i = TRIE_WIDE_SLOTS; i-- > 0; ) {
+            uint16_t idx = TRIE_WIDE_FN(__idx)(nodep->data[i], depth);
+            TRIE_WIDE_KEY* elem_to_insert_atp = &all_new_nodesp[idx].data[TRIE_WIDE_SLOTS - 1 - fill[idx]++];
+            *elem_to_insert_atp = nodep->data[i];
+            if(elem_to_insert_atp == &all_new_nodesp[idx].data[0]) {
+                /* Everything landed in the same subnode */
+                node_to_burst = &all_new_nodesp[idx];
+            }
+        }
+    }
+    if(node_to_burst != NULL) {
+        TRIE_WIDE_FN(__burst_data_node)(triep, node_to_burst, depth+1);
+    }
+    for(uint16_t i = 0; i < TRIE_WIDE_FANOUT; i++) {
+        nodep->link[i] = TAG_PTR(TRIE_WIDE_FN(__slab_child)(all_new_nodesp, depth, i));
+    }
+}
+
+static TRIE_WIDE_NODE* TRIE_WIDE_FN(__follow_travel_node)(TRIE_WIDE_NODE* nodep, uint8_t depth, TRIE_WIDE_KEY value) {
+    return UNTAG_PTR(nodep->link[TRIE_WIDE_FN(__idx)(value, depth)]);
+}
+
+/* Walk from nodep at *depthp down to the data or count node for value. The depth of
+ * an instance is a constant, so from the base node this unrolls into a straight run of
+ * loads with one exit per level */
+static inline TRIE_WIDE_NODE* TRIE_WIDE_FN(__descend)(TRIE_WIDE_NODE* nodep, uint8_t* depthp, TRIE_WIDE_KEY value) {
+    uint8_t depth = *depthp;
+#pragma GCC unroll 64
+    for(; depth < TRIE_WIDE_MAX_DEPTH; depth++) {
+        if(TRIE_WIDE_FN(__node_type)(nodep, depth) != NODE_TYPE_TRAVEL) {
+            break;
+        }
+        nodep = TRIE_WIDE_FN(__follow_travel_node)(nodep, depth, value);
+    }
+    *depthp = depth;
+    return nodep;
+}
+
+struct TRIE_WIDE_STRUCT()* TRIE_WIDE_FN(_init)(void) {
+    struct TRIE_WIDE_STRUCT()* triep = calloc(sizeof(struct TRIE_WIDE_STRUCT()), 1);
+    assert(triep != NULL);
+    triep->base_node = trie__arena_alloc(&triep->arena, sizeof(TRIE_WIDE_NODE));
+    return triep;
+}
+
+void TRIE_WIDE_FN(_free)(struct TRIE_WIDE_STRUCT()** triepp) {
+    trie__arena_free(&(*triepp)->arena);
+    free(*triepp);
+    *triepp = NULL;
+}
+
+void TRIE_WIDE_FN(_reset)(struct TRIE_WIDE_STRUCT()* triep) {
+    trie__arena_reset(&triep->arena);
+    triep->base_node = trie__arena_alloc(&triep->arena, sizeof(TRIE_WIDE_NODE));
+    triep->number_of_zeros = 0;
+}
+
+void TRIE_WIDE_FN(_insert_value)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_KEY value) {
+    if(value == 0) {
+        ++(triep->number_of_zeros);
+        return;
+    }
+    uint8_t current_depth = 0;
+    TRIE_WIDE_NODE* current_node = TRIE_WIDE_FN(__descend)(triep->base_node, &current_depth, value);
+    if(current_depth == TRIE_WIDE_MAX_DEPTH) {
+        ++(*TRIE_WIDE_FN(__count_node_bucket)(current_node, value));
+        return;
+    }
+    TRIE_WIDE_FN(__data_node_insert)(current_node, value);
+    if(current_node->data[0] != 0) {
+        TRIE_WIDE_FN(__burst_data_node)(triep, current_node, current_depth);
+    }
+}
+
+void TRIE_WIDE_FN(_insert_value_n)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_KEY value, uint64_t n) {
+    if(value == 0) {
+        triep->number_of_zeros += n;
+        return;
+    }
+    uint8_t current_depth = 0;
+    TRIE_WIDE_NODE* current_node = triep->base_node;
+    while(n > 0) {
+        current_node = TRIE_WIDE_FN(__descend)(current_node, &current_depth, value);
+        if(current_depth == TRIE_WIDE_MAX_DEPTH) {
+            *TRIE_WIDE_FN(__count_node_bucket)(current_node, value) += n;
+            return;
+        }
+        uint16_t free_slots = TRIE_WIDE_FN(__data_node_free_slots)(current_node);
+        if(n < free_slots) {
+            TRIE_WIDE_FN(__data_node_insert_n)(current_node, value, n);
+            return;
+        }
+        TRIE_WIDE_FN(__data_node_insert_n)(current_node, value, free_slots);
+        TRIE_WIDE_FN(__burst_data_node)(triep, current_node, current_depth);
+        n -= free_slots;
+    }
+}
+
+void TRIE_WIDE_FN(_insert_values)(struct TRIE_WIDE_STRUCT()* triep, const TRIE_WIDE_KEY* values, size_t n) {
+    /* The wide tries are much deeper, so fetch the first two levels of the path ahead
+     * like trie__insert_values_prefetched does below the base node */
+    for(size_t i = 0; i < n; i++) {
+        if(i + TRIE_BATCH_PREFETCH_DISTANCE < n) {
+            TRIE_WIDE_NODE* nodep = triep->base_node;
+            for(uint8_t depth = 0; depth < 2 && TRIE_WIDE_FN(__node_type)(nodep, depth) == NODE_TYPE_TRAVEL; depth++) {
+                nodep = TRIE_WIDE_FN(__follow_travel_node)(nodep, depth, values[i + TRIE_BATCH_PREFETCH_DISTANCE]);
+                __builtin_prefetch(nodep, 1);
+            }
+        }
+        TRIE_WIDE_FN(_insert_value)(triep, values[i]);
+    }
+}
+
+uint64_t TRIE_WIDE_FN(_count)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_KEY value) {
+    if(value == 0) {
+        return triep->number_of_zeros;
+    }
+    uint8_t current_depth = 0;
+    TRIE_WIDE_NODE* current_node = TRIE_WIDE_FN(__descend)(triep->base_node, &current_depth, value);
+    if(current_depth == TRIE_WIDE_MAX_DEPTH) {
+        return *TRIE_WIDE_FN(__count_node_bucket)(current_node, value);
+    }
+    /* Sorted with the smallest value in the last slot */
+    uint64_t count = 0;
+    for(uint16_t i = TRIE_WIDE_SLOTS; i-- > 0 && current_node->data[i] != 0 && current_node->data[i] <= value; ) {
+        count += (current_node->data[i] == value);
+    }
+    return count;
+}
+
+/* value is the smallest value the subtrie at nodep can hold */
+static uint64_t TRIE_WIDE_FN(__count_subtrie_range)(TRIE_WIDE_NODE* nodep, uint8_t depth, TRIE_WIDE_KEY value, TRIE_WIDE_KEY lo, TRIE_WIDE_KEY hi) {
+    uint64_t count = 0;
+    switch(TRIE_WIDE_FN(__node_type)(nodep, depth)) {
+    case NODE_TYPE_COUNT:
+        for(uint16_t i = 0; i < TRIE_WIDE_COUNT_BUCKETS; i++) {
+            if(value + i >= lo && value + i <= hi) {
+                count += ((uint64_t*)nodep)[i];
+            }
+        }
+        break;
+    case NODE_TYPE_DATA:
+        for(uint16_t i = TRIE_WIDE_SLOTS; i-- > 0 && nodep->data[i] != 0 && nodep->data[i] <= hi; ) {
+            count += (nodep->data[i] >= lo);
+        }
+        break;
+    default:
+        for(uint16_t i = 0; i < TRIE_WIDE_FANOUT; i++) {
+            TRIE_WIDE_KEY first = value | ((TRIE_WIDE_KEY)i << TRIE_WIDE_FN(__shift)(depth));
+            TRIE_WIDE_KEY last = first | TRIE_WIDE_FN(__span_mask)(depth+1);
+            if(last >= lo && first <= hi) {
+                count += TRIE_WIDE_FN(__count_subtrie_range)(UNTAG_PTR(nodep->link[i]), depth+1, first, lo, hi);
+            }
+        }
+        break;
+    }
+    return count;
+}
+
+uint64_t TRIE_WIDE_FN(_count_range)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_KEY lo, TRIE_WIDE_KEY hi) {
+    if(lo > hi) {
+        return 0;
+    }
+    uint64_t count = (lo == 0) ? triep->number_of_zeros : 0;
+    return count + TRIE_WIDE_FN(__count_subtrie_range)(triep->base_node, 0, 0, lo, hi);
+}
+
+static bool TRIE_WIDE_FN(__visit_subtrie)(TRIE_WIDE_NODE* nodep, uint8_t depth, TRIE_WIDE_KEY value, TRIE_WIDE_NAME(Visitor_t) visitor, void* ctxp) {
+    switch(TRIE_WIDE_FN(__node_type)(nodep, depth)) {
+    case NODE_TYPE_COUNT:
+        for(uint16_t i = 0; i < TRIE_WIDE_COUNT_BUCKETS; i++) {
+            if(((uint64_t*)nodep)[i] != 0 && !visitor(ctxp, value + i, ((uint64_t*)nodep)[i])) {
+                return false;
+            }
+        }
+        return true;
+    case NODE_TYPE_DATA: {
+        uint16_t i = TRIE_WIDE_SLOTS;
+        while(i > 0 && nodep->data[i-1] != 0) {
+            uint16_t run = 1;
+            while(i - run > 0 && nodep->data[i-1-run] == nodep->data[i-1]) {
+                ++run;
+            }
+            if(!visitor(ctxp, nodep->data[i-1], run)) {
+                return false;
+            }
+            i -= run;
+        }
+        return true;
+    }
+    default:
+        for(uint16_t i = 0; i < TRIE_WIDE_FANOUT; i++) {
+            TRIE_WIDE_KEY first = value | ((TRIE_WIDE_KEY)i << TRIE_WIDE_FN(__shift)(depth));
+            if(!TRIE_WIDE_FN(__visit_subtrie)(UNTAG_PTR(nodep->link[i]), depth+1, first, visitor, ctxp)) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+bool TRIE_WIDE_FN(_visit)(struct TRIE_WIDE_STRUCT()* triep, TRIE_WIDE_NAME(Visitor_t) visitor, void* ctxp) {
+    if(triep->number_of_zeros != 0 && !visitor(ctxp, 0, triep->number_of_zeros)) {
+        return false;
+    }
+    return TRIE_WIDE_FN(__visit_subtrie)(triep->base_node, 0, 0, visitor, ctxp);
+}
+
+#undef TRIE_WIDE_NAME
+#undef TRIE_WIDE_FN
+#undef TRIE_WIDE_STRUCT
+#undef TRIE_WIDE_NODE
+#undef TRIE_WIDE_KEY_BITS
+#undef TRIE_WIDE_FANOUT
+#undef TRIE_WIDE_SLOTS
+#undef TRIE_WIDE_MAX_DEPTH
+#undef TRIE_WIDE_COUNT_BUCKETS
+#undef TRIE_WIDE_TYPE
+#undef TRIE_WIDE_PREFIX
+#undef TRIE_WIDE_KEY
+#undef TRIE_WIDE_LEVEL_BITS